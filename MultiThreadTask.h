@@ -4,8 +4,35 @@
 #include <condition_variable>
 #include <atomic>
 #include <map>
+#include <set>
 #include <vector>
 #include <algorithm>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <ranges>
+#include <tuple>
+#include <coroutine>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <functional>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <bit>
+#include <climits>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 using namespace std;
 
@@ -15,269 +42,4077 @@ namespace multi_task_conveyor {
 	class Job;
 	typedef Job* JOBID;
 
-	class Job
+	constexpr size_t CACHE_LINE_SIZE = 64;
+
+	// hot shared state of jobs, workers and the conveyor sits on separate cache lines, defining MULTI_TASK_CONVEYOR_PACKED_LAYOUT
+	// before including this header packs it instead, so the two layouts can be compared with the same benchmark
+#ifdef MULTI_TASK_CONVEYOR_PACKED_LAYOUT
+#define MULTI_TASK_CONVEYOR_CACHE_ALIGNED
+	constexpr bool PACKED_LAYOUT = true;
+#else
+#define MULTI_TASK_CONVEYOR_CACHE_ALIGNED alignas(CACHE_LINE_SIZE)
+	constexpr bool PACKED_LAYOUT = false;
+#endif
+
+	// ring capacity of every priority lane when max_tasks is not set
+	constexpr size_t DEFAULT_RING_CAPACITY = 1 << 14;
+
+	enum class TaskPriority
 	{
-	public:
-		Job() : m_conveyor(nullptr), m_running_tasks(0) {}
-		virtual ~Job() {}
+		high,
+		normal,
+		low
+	};
 
-		// override this function to prepare and push tasks
-		virtual void process() = 0;
+	constexpr size_t PRIORITY_LANES = 3;
 
-		// override this function to implement some logic after all pushed tasks are done
-		virtual void process_after_done() = 0;
+	struct LaneMetrics
+	{
+		// tasks waiting in the lane now
+		size_t depth = 0;
 
-		void set_conveyor(MultiTask* conveyor) { m_conveyor = conveyor; }
-		MultiTask* get_conveyor() {	return m_conveyor; }
+		// high water mark of depth
+		size_t max_depth = 0;
 
-		JOBID get_id() { return static_cast<JOBID>(this); }
+		unsigned long long pushed = 0;
+		unsigned long long popped = 0;
+	};
 
-		bool is_done() { return m_is_done.test(); }
+	// log linear histogram of nanoseconds, exact below 16, then 8 buckets per power of two (12.5% precision)
+	class LatencyHistogram
+	{
+	public:
+		static constexpr size_t BUCKETS = 16 + 60 * 8;
 
-		void inc_task_count() { ++m_running_tasks; }
-		void dec_task_count() { --m_running_tasks; m_running_tasks.notify_one(); }
-		unsigned long long get_task_count() { return m_running_tasks.load(); }
+		void record(const unsigned long long ns)
+		{
+			++m_buckets[bucket(ns)];
+			++m_count;
+			m_sum += ns;
+			m_max = max(m_max, ns);
+		}
 
-		void wait_until_done() { m_is_done.wait(false); }
+		void merge(const LatencyHistogram& other)
+		{
+			for (size_t i = 0; i < BUCKETS; ++i)
+				m_buckets[i] += other.m_buckets[i];
 
-		void wait_until_all_tasks_done() { 
-			unsigned long t = m_running_tasks;
-			while (t) {
-				m_running_tasks.wait(t);
-				t = m_running_tasks;
-			}
+			m_count += other.m_count;
+			m_sum += other.m_sum;
+			m_max = max(m_max, other.m_max);
+		}
 
-			process_after_done();
+		// lower bound of the bucket holding the q quantile, 0 <= q <= 1
+		unsigned long long percentile(const double q) const
+		{
+			if (m_count == 0)
+				return 0;
 
-			m_is_done.test_and_set();
-			m_is_done.notify_all();
+			const unsigned long long rank = static_cast<unsigned long long>(q * (m_count - 1)) + 1;
+			unsigned long long seen = 0;
+			for (size_t i = 0; i < BUCKETS; ++i)
+				if ((seen += m_buckets[i]) >= rank)
+					return min(bucket_value(i), m_max);
+
+			return m_max;
 		}
 
-		void wait_until_all_tasks_pushed() { m_is_all_task_pushed.wait(false); }
+		unsigned long long count() const { return m_count; }
+		unsigned long long max_value() const { return m_max; }
+		double mean() const { return m_count ? static_cast<double>(m_sum) / m_count : 0.0; }
 
-		void set_all_tasks_pushed()
+	private:
+		static size_t bucket(const unsigned long long ns)
 		{
-			m_is_all_task_pushed.test_and_set();
-			m_is_all_task_pushed.notify_all();
+			if (ns < 16)
+				return static_cast<size_t>(ns);
+
+			const size_t exponent = bit_width(ns) - 1;
+			return 16 + (exponent - 4) * 8 + static_cast<size_t>((ns >> (exponent - 3)) & 7);
 		}
 
-		void reset()
+		static unsigned long long bucket_value(const size_t index)
 		{
-			m_is_all_task_pushed.clear();
-			m_is_done.clear();
+			if (index < 16)
+				return index;
+
+			const size_t exponent = (index - 16) / 8 + 4;
+			return (8ull + (index - 16) % 8) << (exponent - 3);
 		}
 
-	private:
-		atomic_flag m_is_all_task_pushed;
-		atomic_flag m_is_done;
-		MultiTask* m_conveyor;
-		atomic_ulong m_running_tasks;
+		unsigned long long m_buckets[BUCKETS]{};
+		unsigned long long m_count = 0;
+		unsigned long long m_sum = 0;
+		unsigned long long m_max = 0;
 	};
 
-	class Task
+	// time from push to the start of process() and time in process()
+	struct TaskLatency
 	{
-	public:
-		Task(JOBID jobid) : m_jobid(jobid) {}
-		virtual ~Task() {}
+		LatencyHistogram queue_wait;
+		LatencyHistogram run_time;
 
-		JOBID get_id() { return m_jobid; }
+		void merge(const TaskLatency& other)
+		{
+			queue_wait.merge(other.queue_wait);
+			run_time.merge(other.run_time);
+		}
+	};
 
-		// override this function for processing logic
-		virtual void process() = 0;
+	struct LatencySnapshot
+	{
+		TaskLatency total;
 
-	private:
-		const JOBID m_jobid;
+		// indexed by worker index
+		vector<TaskLatency> workers;
+
+		// job-less tasks are under nullptr, every worker keeps the last 64 jobs,
+		// older ones and dead jobs whose address was reused count in total and workers only
+		map<JOBID, TaskLatency> jobs;
 	};
 
-	class MultiTask
+	// timeline of the conveyor threads, recorded only if MULTI_TASK_CONVEYOR_TRACE is defined before including this header,
+	// every thread writes its own ring of the last MULTI_TASK_CONVEYOR_TRACE_EVENTS events without locks,
+	// write_chrome_json() dumps them in Chrome trace format, chrome://tracing and ui.perfetto.dev open it
+#ifndef MULTI_TASK_CONVEYOR_TRACE_EVENTS
+#define MULTI_TASK_CONVEYOR_TRACE_EVENTS (1 << 16)
+#endif
+
+	class Trace
 	{
 	public:
-		MultiTask(const unsigned int task_threads = 0, const unsigned int max_tasks = 0)
+#ifdef MULTI_TASK_CONVEYOR_TRACE
+		static constexpr bool enabled = true;
+#else
+		static constexpr bool enabled = false;
+#endif
+
+		static long long now()
 		{
-			init(task_threads, max_tasks);
+			return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
 		}
 
-		~MultiTask()
+		// an event lasting from start till now, name must be a string literal
+		static void complete(const char* name, const unsigned long long arg, const long long start)
 		{
-			terminate();
+			record(name, arg, start, now() - start);
 		}
 
-		void init(const unsigned int task_threads, const unsigned int max_tasks)
+		static void complete(const char* name, const unsigned long long arg, const chrono::steady_clock::time_point start, const chrono::steady_clock::time_point end)
 		{
-			m_max_tasks = max_tasks;
+			record(name, arg, chrono::duration_cast<chrono::nanoseconds>(start.time_since_epoch()).count(), chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+		}
 
-			int task_threads_count = (task_threads == 0 ? thread::hardware_concurrency() - 1 : task_threads);
-			if (!task_threads_count)
-				++task_threads_count;
+		static void instant(const char* name, const unsigned long long arg)
+		{
+			record(name, arg, now(), -1);
+		}
 
-			// tasks init
-			m_tasks.reserve(task_threads_count);
-			for (int i = 0; i < task_threads_count; ++i)
-				m_tasks.emplace_back(&MultiTask::process_task, this);
+		// the calling thread name in the trace
+		static void set_thread_name(const string& name)
+		{
+			buffer().name = name;
 		}
 
-		void terminate()
+		// events written while dumping may come out torn, dump when the conveyor is quiet
+		static void write_chrome_json(ostream& out)
 		{
-			m_task_queue_mutex.lock();
+			lock_guard lk(s_mutex);
+
+			long long origin = LLONG_MAX;
+			for (auto& buffer : s_buffers)
+				for (size_t i = buffer->first(); i < buffer->head.load(memory_order_acquire); ++i)
+					origin = min(origin, buffer->events[i % buffer->events.size()].ts);
 
-			m_tasks_queue.clear();
+			out << "{\"traceEvents\":[";
 
-			m_tasks_queue.push_back(unique_ptr<Task>());
+			bool first = true;
+			for (auto& buffer : s_buffers)
+			{
+				out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+					<< ",\"args\":{\"name\":\"" << (buffer->name.empty() ? "thread " + to_string(buffer->tid) : buffer->name) << "\"}}";
+				first = false;
 
-			m_task_queue_mutex.unlock();
+				for (size_t i = buffer->first(); i < buffer->head.load(memory_order_acquire); ++i)
+				{
+					const Event& event = buffer->events[i % buffer->events.size()];
 
-			m_new_task_cv.notify_all();
+					out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"conveyor\",\"pid\":1,\"tid\":" << buffer->tid
+						<< ",\"ts\":" << (event.ts - origin) / 1000.0;
 
-			for (auto& t : m_tasks)
-				t.join();
+					if (event.dur >= 0)
+						out << ",\"ph\":\"X\",\"dur\":" << event.dur / 1000.0;
+					else
+						out << ",\"ph\":\"i\",\"s\":\"t\"";
 
-			m_tasks.clear();
-			m_tasks_queue.clear();
+					out << ",\"args\":{\"arg\":\"0x" << hex << event.arg << dec << "\"}}";
+				}
+			}
+
+			out << "\n]}\n";
 		}
 
-		// tasks functions
-		template<derived_from<Task> T>
-		void push_task(unique_ptr<T>&& task)
+		static void clear()
+		{
+			lock_guard lk(s_mutex);
+
+			for (auto& buffer : s_buffers)
+				buffer->tail = buffer->head.load(memory_order_acquire);
+		}
+
+	private:
+		struct Event
 		{
-			unique_lock lk(m_task_queue_mutex);
+			const char* name;
+			unsigned long long arg;
+			long long ts;
 
-			if (m_max_tasks && m_tasks_queue.size() == m_max_tasks)
-				m_task_done.wait(lk, [this]() {return m_tasks_queue.size() < m_max_tasks; });
+			// -1 - instant event
+			long long dur;
+		};
 
-			task->get_id()->inc_task_count();
-			m_tasks_queue.push_back(forward<unique_ptr<T>>(task));
+		struct ThreadBuffer
+		{
+			ThreadBuffer(const unsigned int thread_id) : tid(thread_id), events(MULTI_TASK_CONVEYOR_TRACE_EVENTS) {}
 
-			lk.unlock();
+			// the oldest event kept
+			size_t first() const
+			{
+				const size_t h = head.load(memory_order_acquire);
+				return max(tail, h > events.size() ? h - events.size() : 0);
+			}
+
+			const unsigned int tid;
+			string name;
+			vector<Event> events;
+
+			// written by the owner thread only
+			atomic_size_t head{ 0 };
+
+			// guarded by s_mutex
+			size_t tail = 0;
+		};
+
+		static void record(const char* name, const unsigned long long arg, const long long ts, const long long dur)
+		{
+			if constexpr (enabled)
+			{
+				ThreadBuffer& b = buffer();
+				const size_t h = b.head.load(memory_order_relaxed);
 
-			m_new_task_cv.notify_all();
+				b.events[h % b.events.size()] = Event{ name, arg, ts, dur };
+				b.head.store(h + 1, memory_order_release);
+			}
 		}
 
-		template<derived_from<Task> T, class... Args>
-		void emplace_task(Args&& ...args)
+		// hands the buffer over to the next thread when its thread exits
+		struct BufferOwner
 		{
-			push_task<T>(forward<unique_ptr<T>>(make_unique<T>(forward<Args>(args)...)));
+			~BufferOwner()
+			{
+				if (!buffer)
+					return;
+
+				lock_guard lk(s_mutex);
+				s_free.push_back(buffer);
+				buffer = nullptr;
+			}
+
+			ThreadBuffer* buffer = nullptr;
+		};
+
+		// buffers stay registered after their threads exit, so the dump still has their events,
+		// a new thread reuses the buffer of an exited one, so buffers are bounded by the threads alive at once,
+		// one trace thread may show several threads that did not run at the same time
+		static ThreadBuffer& buffer()
+		{
+			thread_local BufferOwner t_owner;
+			if (!t_owner.buffer)
+			{
+				lock_guard lk(s_mutex);
+				if (s_free.empty())
+				{
+					s_buffers.push_back(make_unique<ThreadBuffer>(static_cast<unsigned int>(s_buffers.size() + 1)));
+					t_owner.buffer = s_buffers.back().get();
+				}
+				else
+				{
+					// the events of the exited thread stay until the ring wraps
+					t_owner.buffer = s_free.back();
+					s_free.pop_back();
+					t_owner.buffer->name.clear();
+				}
+			}
+
+			return *t_owner.buffer;
 		}
 
-		// jobs functions
-		template<derived_from<Job> T>
-		T* push_job(unique_ptr<T>&& job)
+		inline static mutex s_mutex;
+		inline static vector<unique_ptr<ThreadBuffer>> s_buffers;
+
+		// buffers of exited threads
+		inline static vector<ThreadBuffer*> s_free;
+	};
+
+	struct WorkerStats
+	{
+		// the thread is started, extra workers of the elastic pool come and go
+		bool running = false;
+
+		// worker_cpus, or sched_policy, sched_priority and nice, could not be applied to the worker thread
+		bool affinity_failed = false;
+		bool scheduling_failed = false;
+
+		unsigned long long tasks_completed = 0;
+
+		// since the worker thread start, the current idle period is idle even if parked
+		chrono::nanoseconds busy{ 0 };
+		chrono::nanoseconds idle{ 0 };
+		chrono::nanoseconds parked{ 0 };
+	};
+
+	struct MultiTaskStats
+	{
+		// tasks waiting in the shared queues, rings and local deques
+		size_t queue_depth = 0;
+
+		// sum of the shared queues and rings high water marks
+		size_t max_queue_depth = 0;
+
+		unsigned long long tasks_pushed = 0;
+		unsigned long long tasks_completed = 0;
+
+		// since the previous stats() call, or since the start
+		double pushed_per_second = 0;
+		double completed_per_second = 0;
+
+		// pushes blocked by max_tasks or a full ring, and the time spent blocked
+		unsigned long long backpressure_stalls = 0;
+		chrono::nanoseconds backpressure_time{ 0 };
+
+		// jobs in the jobs map
+		size_t jobs = 0;
+
+		unsigned int workers_running = 0;
+		vector<WorkerStats> workers;
+	};
+
+	enum class SchedulerMode
+	{
+		// all workers share one mutex protected tasks queue
+		global_queue,
+
+		// every worker owns a local deque, tasks pushed from a worker stay local and idle workers steal,
+		// job weights apply to the shared queue only, not to the local deques
+		work_stealing,
+
+		// all workers share one lock free bounded ring per priority, max_tasks is the ring capacity,
+		// the rings are plain FIFOs, so job weights don't apply, see Job::set_weight()
+		lock_free_ring
+	};
+
+	struct MultiTaskOptions
+	{
+		// number of task executing threads, 0 - hardware concurrency minus one
+		unsigned int task_threads = 0;
+
+		// max tasks quantity in the shared queue (in every node queue if numa_aware), 0 - unlimited (DEFAULT_RING_CAPACITY for lock_free_ring)
+		// only threads that are not workers wait for a free place, workers run queued tasks meanwhile
+		unsigned int max_tasks = 0;
+
+		SchedulerMode scheduler = SchedulerMode::global_queue;
+
+		// max tasks a worker takes from the shared queue at once, shrinks to a fair share of a short queue
+		unsigned int max_batch_size = 8;
+
+		// max threads running jobs, started on demand and reused when idle, 0 - hardware concurrency,
+		// threads blocked in wait_job_done() don't count, the extra ones retire after idle_timeout_ms without jobs
+		unsigned int job_threads = 0;
+
+		// elastic pool: up to max_task_threads workers, extra workers over task_threads are started when nobody is idle
+		// and grow_queue_depth tasks are waiting, they retire after idle_timeout_ms without tasks, 0 - fixed pool
+		unsigned int max_task_threads = 0;
+		unsigned int grow_queue_depth = 16;
+		unsigned int idle_timeout_ms = 1000;
+
+		// a worker out of tasks spins for up to idle_spin_us, then yields for up to idle_yield_us, then parks,
+		// adaptive_idle shortens the wait to twice the usual gap between tasks of the worker and skips it while the gaps keep being longer,
+		// spinning is skipped unless there are fewer workers than cpus, the producers need a cpu too
+		unsigned int idle_spin_us = 10;
+		unsigned int idle_yield_us = 50;
+		bool adaptive_idle = true;
+
+		// queue wait and run time histograms of every task per worker and per job, see latency_snapshot()
+		bool collect_latency = false;
+
+		// pins workers to cpus spread over the NUMA nodes, every node gets its own shared queue,
+		// workers take tasks and steal within their node first, allocate tasks from a pool per node
+		// and their deques on their node (linux only, one node elsewhere)
+		bool numa_aware = false;
+
+		// sysfs directory the NUMA topology is read from, another one describes a made up topology, e.g. in tests
+		string numa_sysfs_path = "/sys/devices/system/node";
+
+		// the rest is applied on linux only, a worker that did not get its cpus or scheduling says so in stats()
+
+		// cpus allowed for worker i are worker_cpus[i % size], empty - numa placement or any cpu
+		vector<vector<unsigned int>> worker_cpus;
+
+		// workers are named thread_name + index, thread_name is cut so that the name fits 15 chars, empty - not named
+		string thread_name;
+
+		// scheduling policy (SCHED_OTHER, SCHED_FIFO, SCHED_RR, SCHED_BATCH, SCHED_IDLE) and its priority, -1 - inherited
+		int sched_policy = -1;
+		int sched_priority = 0;
+
+		// nice value of the workers, 0 - inherited
+		int nice = 0;
+	};
+
+	class Job
+	{
+	public:
+		// the job holds one count itself until all tasks are pushed
+		Job() : m_conveyor(nullptr), m_running_tasks(1) {}
+		virtual ~Job() {}
+
+		// override this function to prepare and push tasks
+		virtual void process() = 0;
+
+		// override this function to implement some logic after all pushed tasks are done
+		virtual void process_after_done() = 0;
+
+		// co_await job resumes the coroutine when the job is done, on the thread completing it
+		class Awaiter
 		{
-			auto job_ptr = job.get();
+		public:
+			Awaiter(Job& job) : m_job(job) {}
 
-			JOBID jobid = static_cast<JOBID>(job_ptr);
-			job->set_conveyor(this);
+			bool await_ready() { return m_job.is_done(); }
+			bool await_suspend(coroutine_handle<> handle) { m_handle = handle; return m_job.add_awaiter(this); }
+			void await_resume() {}
 
-			unique_lock ul(m_job_map_mutex);
-			if (auto [new_obj_itt, is_success] = m_jobs_map.try_emplace(jobid, forward<unique_ptr<T>>(job)); !is_success)
-				return job_ptr;
+		private:
+			friend class Job;
 
-			ul.unlock();
+			Job& m_job;
+			coroutine_handle<> m_handle;
+			Awaiter* m_next = nullptr;
+		};
 
-			thread job_thread(&MultiTask::process_job, this, job_ptr);
-			job_thread.detach();
+		Awaiter operator co_await() { return Awaiter(*this); }
 
-			return job_ptr;
+		void set_conveyor(MultiTask* conveyor) { m_conveyor = conveyor; }
+		MultiTask* get_conveyor() {	return m_conveyor; }
+
+		JOBID get_id() { return static_cast<JOBID>(this); }
+
+		// default priority of the job tasks
+		void set_priority(const TaskPriority priority) { m_priority = priority; }
+		TaskPriority get_priority() { return m_priority; }
+
+		// share of the shared queue against other jobs of the same priority, tasks per round,
+		// no effect in lock_free_ring mode and on the tasks a worker pushes to its own deque in work_stealing mode
+		void set_weight(const unsigned int weight) { m_weight = max(weight, 1u); }
+		unsigned int get_weight() { return m_weight; }
+
+		// true when the job is not accessed by the completing thread anymore, it may be destroyed then
+		bool is_done() { return m_awaiters.load(memory_order_acquire) == completed_mark(); }
+
+		void inc_task_count(const unsigned long count = 1) { m_running_tasks += count; }
+
+		// the thread dropping the count to zero completes the job, nobody waits for the counter
+		void dec_task_count(const unsigned long count = 1)
+		{
+			if (m_running_tasks.fetch_sub(count) == count)
+				complete();
 		}
 
-		template<derived_from<Job> T, class... Args>
-		T* emplace_job(Args&& ...args)
+		// approximate while tasks are running
+		unsigned long long get_task_count()
 		{
-			return push_job<T>(forward<unique_ptr<T>>(make_unique<T>(forward<Args>(args)...)));
+			const unsigned long long count = m_running_tasks.load();
+			return (count && !m_is_all_task_pushed.test()) ? count - 1 : count;
 		}
 
-		auto pop_job(const JOBID jobid)
+		// m_is_done is set just before the completing thread's last access to the job
+		void wait_until_done()
 		{
-			unique_lock ul(m_job_map_mutex);
-			auto node = m_jobs_map.extract(jobid);
+			m_is_done.wait(false);
 
-			if (node.empty())
-				return unique_ptr<remove_pointer_t<decltype(jobid)>>{};
-			else
-				return unique_ptr<remove_pointer_t<decltype(jobid)>>(static_cast<decltype(jobid)>(node.mapped().release()));
+			while (!is_done())
+				this_thread::yield();
 		}
 
-		void restart_job(const JOBID jobid)
+		// process_after_done() is called by the thread completing the last task, this only waits for it
+		void wait_until_all_tasks_done() { wait_until_done(); }
+
+		void wait_until_all_tasks_pushed() { m_is_all_task_pushed.wait(false); }
+
+		// may be called in process() too, only the first call counts
+		void set_all_tasks_pushed()
 		{
-			if (jobid == nullptr)
+			if (m_is_all_task_pushed.test_and_set())
 				return;
 
-			jobid->reset();
+			m_is_all_task_pushed.notify_all();
 
-			thread job_thread(&MultiTask::process_job, this, jobid);
-			job_thread.detach();
+			// drop the count held while pushing, completes the job if all tasks are already done
+			dec_task_count();
 		}
 
-		bool check_job_is_done(const JOBID jobid)
+		// completes a job that was never started, process() and process_after_done() are not called
+		void cancel()
 		{
-			if (jobid == nullptr)
-				return true;
+			m_is_cancelled.test_and_set();
+			m_is_all_task_pushed.test_and_set();
+			m_is_all_task_pushed.notify_all();
 
-			return jobid->get_task_count() == 0;
+			finish();
 		}
 
-		void wait_job_done(const JOBID jobid)
-		{
-			if (jobid == nullptr)
-				return;
+		bool is_cancelled() { return m_is_cancelled.test(); }
 
-			jobid->wait_until_done();
+		void reset()
+		{
+			m_is_cancelled.clear();
+			m_is_all_task_pushed.clear();
+			m_is_done.clear();
+			m_running_tasks = 1;
+			m_awaiters = nullptr;
 		}
 
-		void process_task()
+	private:
+		friend class MultiTask;
+
+		// the job itself marks the awaiters list of a completed job
+		Awaiter* completed_mark() { return reinterpret_cast<Awaiter*>(this); }
+
+		// returns false if the job is already completed and the coroutine must not suspend
+		bool add_awaiter(Awaiter* awaiter)
 		{
-			while (1)
+			Awaiter* head = m_awaiters.load(memory_order_acquire);
+			do
 			{
-				unique_lock lk(m_task_queue_mutex);
-
-				m_new_task_cv.wait(lk, [this]() {return m_tasks_queue.size() > 0; });
+				if (head == completed_mark())
+					return false;
 
-				auto& task_ref = m_tasks_queue.front();
+				awaiter->m_next = head;
+			} while (!m_awaiters.compare_exchange_weak(head, awaiter, memory_order_acq_rel, memory_order_acquire));
 
-				if (task_ref.get() == nullptr)
-					break;
+			return true;
+		}
 
-				auto task = move(task_ref);
-				m_tasks_queue.pop_front();
+		void complete()
+		{
+			if constexpr (Trace::enabled)
+			{
+				const long long start = Trace::now();
+				process_after_done();
+				Trace::complete("process_after_done", reinterpret_cast<unsigned long long>(this), start);
+			}
+			else
+				process_after_done();
 
-				lk.unlock();
+			finish();
+		}
 
-				task->process();
+		// the awaiters exchange is the last access to the job, is_done() turns true with it
+		void finish()
+		{
+			m_is_done.test_and_set();
+			m_is_done.notify_all();
 
-				task->get_id()->dec_task_count();
+			Awaiter* awaiters = m_awaiters.exchange(completed_mark(), memory_order_acq_rel);
 
-				m_task_done.notify_all();
+			// the job may be already destroyed here, awaiters live in the coroutine frames
+			while (awaiters)
+			{
+				Awaiter* next = awaiters->m_next;
+				awaiters->m_handle.resume();
+				awaiters = next;
 			}
 		}
 
-		void process_job(Job* job)
+		// read mostly
+		MultiTask* m_conveyor;
+		TaskPriority m_priority = TaskPriority::normal;
+		atomic_uint m_weight{ 1 };
+
+		// tells apart jobs at the same address, 0 is no job
+		inline static atomic_ullong s_serials{ 0 };
+		const unsigned long long m_serial = s_serials.fetch_add(1, memory_order_relaxed) + 1;
+
+		// written once per run
+		atomic_flag m_is_all_task_pushed;
+		atomic_flag m_is_done;
+		atomic_flag m_is_cancelled;
+
+		// coroutines waiting for the job
+		atomic<Awaiter*> m_awaiters = nullptr;
+
+		// every task push and completion writes the counter, the padding keeps it alone on its cache line
+		// without alignas, coroutine frames holding jobs are not over-aligned
+#ifndef MULTI_TASK_CONVEYOR_PACKED_LAYOUT
+		char m_running_tasks_pad[CACHE_LINE_SIZE];
+#endif
+		atomic_ulong m_running_tasks;
+#ifndef MULTI_TASK_CONVEYOR_PACKED_LAYOUT
+		char m_derived_pad[CACHE_LINE_SIZE - sizeof(atomic_ulong)];
+#endif
+	};
+
+	// return type of a coroutine running as a job: the job is done when the coroutine body has finished
+	// and all tasks it pushed with its id are done, so it can be awaited with co_await like any Job,
+	// co_await CoroutineJob::current_id() gives the id inside the coroutine body
+	class CoroutineJob
+	{
+	public:
+		struct promise_type
 		{
-			job->process();
+			class PromiseJob final : public Job
+			{
+			public:
+				void process() override {}
+				void process_after_done() override {}
+			};
 
-			job->set_all_tasks_pushed();
+			CoroutineJob get_return_object() { return CoroutineJob(coroutine_handle<promise_type>::from_promise(*this)); }
 
-			job->wait_until_all_tasks_done();
-		}
+			// the coroutine starts on the calling thread, co_await MultiTask::schedule() moves it to a worker
+			suspend_never initial_suspend() noexcept { return {}; }
 
-	private:
+			auto final_suspend() noexcept
+			{
+				struct FinalAwaiter
+				{
+					bool await_ready() noexcept { return false; }
+					void await_suspend(coroutine_handle<promise_type> handle) noexcept { handle.promise().job.set_all_tasks_pushed(); }
+					void await_resume() noexcept {}
+				};
 
-		// jobs map
-		map<JOBID, unique_ptr<Job>> m_jobs_map;
+				return FinalAwaiter{};
+			}
 
-		// syncronisation objects for jobs map
-		mutex m_job_map_mutex;
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
 
-		// max tasks quantity
-		unsigned int m_max_tasks;
+			PromiseJob job;
+		};
+
+		// never suspends, only reads the job id from the promise
+		class IdAwaiter
+		{
+		public:
+			bool await_ready() { return false; }
+			bool await_suspend(coroutine_handle<promise_type> handle) { m_id = handle.promise().job.get_id(); return false; }
+			JOBID await_resume() { return m_id; }
+
+		private:
+			JOBID m_id = nullptr;
+		};
+
+		static IdAwaiter current_id() { return {}; }
+
+		CoroutineJob(CoroutineJob&& other) noexcept : m_handle(exchange(other.m_handle, nullptr)) {}
+		CoroutineJob(const CoroutineJob&) = delete;
+		CoroutineJob& operator=(const CoroutineJob&) = delete;
+
+		// the frame holds the job, so it lives until the job is done
+		~CoroutineJob()
+		{
+			if (m_handle)
+			{
+				wait_until_done();
+				m_handle.destroy();
+			}
+		}
+
+		JOBID get_id() { return m_handle.promise().job.get_id(); }
+
+		bool is_done() { return m_handle.promise().job.is_done(); }
+
+		void wait_until_done() { m_handle.promise().job.wait_until_done(); }
+
+		Job::Awaiter operator co_await() { return Job::Awaiter(m_handle.promise().job); }
+
+	private:
+		explicit CoroutineJob(coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+		coroutine_handle<promise_type> m_handle;
+	};
+
+	// size class pool for Task objects: every thread allocates from and frees to its own free lists,
+	// which exchange fixed size batches of blocks with a shared depot, so a task created on a job thread
+	// and destroyed on a worker never reaches the general purpose allocator, trim() releases the slabs
+	// a burst of tasks left idle in the depots
+	class TaskAllocator
+	{
+	public:
+		static constexpr size_t GRANULARITY = 16;
+		static constexpr size_t MAX_BLOCK_SIZE = 256;
+		static constexpr size_t CLASSES = MAX_BLOCK_SIZE / GRANULARITY;
+
+		// blocks moved between a thread cache and the depot at once
+		static constexpr size_t BATCH_SIZE = 64;
+
+		// one depot per NUMA node, nodes above wrap around
+		static constexpr size_t MAX_NODES = 16;
+
+		// free blocks of a size class a depot keeps when it trims
+		static constexpr size_t MAX_CACHED_BLOCKS = 16 * BATCH_SIZE;
+
+		// the calling thread takes blocks from the depot of the node and returns freed ones there,
+		// a pinned thread carves the node slabs itself, so their pages are first touched on the node,
+		// threads that never call it use node 0
+		static void set_thread_node(const unsigned int node)
+		{
+			t_node = node % MAX_NODES;
+		}
+
+		static void* allocate(const size_t size)
+		{
+			if (size > MAX_BLOCK_SIZE)
+				return ::operator new(size);
+
+			const size_t size_class = class_of(size);
+
+			if (!t_cache_alive)
+				return depot().allocate_one(size_class);
+
+			ThreadCache& cache = thread_cache();
+			if (cache.lists[size_class] == nullptr)
+			{
+				const Batch batch = depot().pop_batch(size_class);
+				cache.lists[size_class] = batch.head;
+				cache.counts[size_class] = batch.count;
+			}
+
+			FreeBlock* block = cache.lists[size_class];
+			cache.lists[size_class] = block->next;
+			--cache.counts[size_class];
+
+			return block;
+		}
+
+		// releases the slabs whose blocks are all back in one depot, down to MAX_CACHED_BLOCKS free blocks per size class,
+		// blocks held by thread caches keep their slabs, an idle worker calls it before parking
+		static void trim()
+		{
+			for (atomic<Depot*>& instance : depots())
+				if (Depot* depot = instance.load(memory_order_acquire))
+					depot->trim();
+		}
+
+		static void deallocate(void* ptr, const size_t size)
+		{
+			if (ptr == nullptr)
+				return;
+
+			if (size > MAX_BLOCK_SIZE)
+			{
+				::operator delete(ptr);
+				return;
+			}
+
+			const size_t size_class = class_of(size);
+			FreeBlock* block = static_cast<FreeBlock*>(ptr);
+
+			// thread cache is already destroyed on this thread, e.g. tasks destroyed at exit
+			if (!t_cache_alive)
+			{
+				depot().deallocate_one(size_class, block);
+				return;
+			}
+
+			ThreadCache& cache = thread_cache();
+			block->next = cache.lists[size_class];
+			cache.lists[size_class] = block;
+
+			// keep one batch for reuse, return the other to the depot
+			if (++cache.counts[size_class] >= 2 * BATCH_SIZE)
+				cache.flush(size_class, BATCH_SIZE);
+		}
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		// null terminated list of blocks
+		struct Batch
+		{
+			FreeBlock* head;
+			size_t count;
+		};
+
+		static size_t class_of(const size_t size) { return size ? (size - 1) / GRANULARITY : 0; }
+
+		class Depot
+		{
+		public:
+			static constexpr size_t SLAB_SIZE = 64 * 1024;
+			static_assert(SLAB_SIZE / MAX_BLOCK_SIZE >= BATCH_SIZE);
+
+			Batch pop_batch(const size_t size_class)
+			{
+				lock_guard lk(m_mutex);
+
+				auto& batches = m_batches[size_class];
+				if (batches.empty())
+					carve_slab(size_class);
+
+				const Batch batch = batches.back();
+				batches.pop_back();
+				m_free_blocks[size_class] -= batch.count;
+
+				return batch;
+			}
+
+			void push_batch(const size_t size_class, const Batch batch)
+			{
+				lock_guard lk(m_mutex);
+
+				m_batches[size_class].push_back(batch);
+				m_free_blocks[size_class] += batch.count;
+				m_returned[size_class] += batch.count;
+			}
+
+			FreeBlock* allocate_one(const size_t size_class)
+			{
+				lock_guard lk(m_mutex);
+
+				auto& batches = m_batches[size_class];
+				if (batches.empty())
+					carve_slab(size_class);
+
+				// the rest of the batch stays in the depot
+				Batch& batch = batches.back();
+				FreeBlock* block = batch.head;
+				batch.head = block->next;
+				if (--batch.count == 0)
+					batches.pop_back();
+				--m_free_blocks[size_class];
+
+				return block;
+			}
+
+			void deallocate_one(const size_t size_class, FreeBlock* block)
+			{
+				lock_guard lk(m_mutex);
+
+				block->next = nullptr;
+				m_batches[size_class].push_back({ block, 1 });
+				++m_free_blocks[size_class];
+				++m_returned[size_class];
+			}
+
+			void trim()
+			{
+				lock_guard lk(m_mutex);
+
+				// sorting the free blocks pays off only if a good part of them came back since the last trim
+				for (size_t size_class = 0; size_class < CLASSES; ++size_class)
+					if (m_free_blocks[size_class] > MAX_CACHED_BLOCKS && 4 * m_returned[size_class] >= m_free_blocks[size_class])
+						trim_class(size_class);
+			}
+
+		private:
+			static size_t slab_blocks(const size_t size_class)
+			{
+				return SLAB_SIZE / ((size_class + 1) * GRANULARITY) / BATCH_SIZE * BATCH_SIZE;
+			}
+
+			// called under m_mutex
+			void carve_slab(const size_t size_class)
+			{
+				const size_t block_size = (size_class + 1) * GRANULARITY;
+				const size_t blocks = slab_blocks(size_class);
+
+				char* slab = static_cast<char*>(::operator new(blocks * block_size));
+
+				SlabRegistry& registry = slab_registry();
+				lock_guard slabs_lk(registry.slabs_mutex);
+				registry.slabs.insert(slab);
+
+				for (size_t first = 0; first < blocks; first += BATCH_SIZE)
+				{
+					for (size_t i = first; i < first + BATCH_SIZE; ++i)
+						reinterpret_cast<FreeBlock*>(slab + i * block_size)->next =
+							(i + 1 < first + BATCH_SIZE) ? reinterpret_cast<FreeBlock*>(slab + (i + 1) * block_size) : nullptr;
+
+					m_batches[size_class].push_back({ reinterpret_cast<FreeBlock*>(slab + first * block_size), BATCH_SIZE });
+				}
+
+				m_free_blocks[size_class] += blocks;
+			}
+
+			// called under m_mutex, releases the slabs with all their blocks here and batches the rest again
+			void trim_class(const size_t size_class)
+			{
+				auto& batches = m_batches[size_class];
+
+				vector<FreeBlock*> blocks;
+				blocks.reserve(m_free_blocks[size_class]);
+				for (const Batch& batch : batches)
+				{
+					FreeBlock* block = batch.head;
+					for (size_t i = 0; i < batch.count; ++i, block = block->next)
+						blocks.push_back(block);
+				}
+
+				batches.clear();
+
+				// the blocks of a slab come one after another in address order
+				sort(blocks.begin(), blocks.end(), less<FreeBlock*>());
+
+				const size_t per_slab = slab_blocks(size_class);
+				const size_t slab_bytes = per_slab * (size_class + 1) * GRANULARITY;
+				size_t free_blocks = blocks.size();
+				size_t kept = 0;
+
+				SlabRegistry& registry = slab_registry();
+				lock_guard slabs_lk(registry.slabs_mutex);
+
+				for (size_t first = 0, last = 0; first < blocks.size(); first = last)
+				{
+					// the slab starting last at or before the block holds it
+					const auto slab = prev(registry.slabs.upper_bound(reinterpret_cast<char*>(blocks[first])));
+					while (last < blocks.size() && less<char*>()(reinterpret_cast<char*>(blocks[last]), *slab + slab_bytes))
+						++last;
+
+					if (last - first == per_slab && free_blocks - per_slab >= MAX_CACHED_BLOCKS)
+					{
+						::operator delete(*slab);
+						registry.slabs.erase(slab);
+						free_blocks -= per_slab;
+					}
+					else if (kept == first)
+						kept = last;
+					else
+					{
+						// kept < first, the kept blocks are moved down before anything is overwritten
+						copy(blocks.begin() + first, blocks.begin() + last, blocks.begin() + kept);
+						kept += last - first;
+					}
+				}
+
+				for (size_t first = 0; first < kept; first += BATCH_SIZE)
+				{
+					const size_t count = min(BATCH_SIZE, kept - first);
+					for (size_t i = first; i + 1 < first + count; ++i)
+						blocks[i]->next = blocks[i + 1];
+					blocks[first + count - 1]->next = nullptr;
+
+					batches.push_back({ blocks[first], count });
+				}
+
+				m_free_blocks[size_class] = kept;
+				m_returned[size_class] = 0;
+			}
+
+			mutex m_mutex;
+			vector<Batch> m_batches[CLASSES];
+
+			// blocks in m_batches, and the ones pushed back since the last trim
+			size_t m_free_blocks[CLASSES]{};
+			size_t m_returned[CLASSES]{};
+		};
+
+		// start of every slab of every depot, the blocks of a slab may end up in other node depots,
+		// the mutex is taken after a depot one
+		struct SlabRegistry
+		{
+			mutex slabs_mutex;
+			set<char*> slabs;
+		};
+
+		// never destroyed, like the depots
+		static SlabRegistry& slab_registry()
+		{
+			static SlabRegistry* registry = new SlabRegistry;
+			return *registry;
+		}
+
+		struct ThreadCache
+		{
+			~ThreadCache()
+			{
+				t_cache_alive = false;
+
+				for (size_t size_class = 0; size_class < CLASSES; ++size_class)
+					while (counts[size_class])
+						flush(size_class, min(counts[size_class], BATCH_SIZE));
+			}
+
+			void flush(const size_t size_class, const size_t count)
+			{
+				FreeBlock* batch = lists[size_class];
+				FreeBlock* last = batch;
+				for (size_t i = 1; i < count; ++i)
+					last = last->next;
+
+				lists[size_class] = last->next;
+				last->next = nullptr;
+				counts[size_class] -= count;
+
+				depot().push_batch(size_class, { batch, count });
+			}
+
+			FreeBlock* lists[CLASSES]{};
+			size_t counts[CLASSES]{};
+		};
+
+		using Depots = atomic<Depot*>[MAX_NODES];
+
+		static Depots& depots()
+		{
+			static atomic<Depot*> instances[MAX_NODES];
+			return instances;
+		}
+
+		// never destroyed, threads may free tasks during static destruction
+		static Depot& depot()
+		{
+			atomic<Depot*>& instance = depots()[t_node];
+			Depot* depot = instance.load(memory_order_acquire);
+			if (depot == nullptr)
+			{
+				Depot* created = new Depot;
+				if (instance.compare_exchange_strong(depot, created, memory_order_acq_rel))
+					depot = created;
+				else
+					delete created;
+			}
+
+			return *depot;
+		}
+
+		static ThreadCache& thread_cache()
+		{
+			thread_local ThreadCache cache;
+			return cache;
+		}
+
+		inline static thread_local bool t_cache_alive = true;
+		inline static thread_local size_t t_node = 0;
+	};
+
+	class Task
+	{
+	public:
+		// a task with nullptr jobid does not belong to any job and is not counted
+		Task(JOBID jobid) : m_jobid(jobid) {}
+		virtual ~Task() {}
+
+		// tasks are allocated from TaskAllocator, unique_ptr<Task> with the default deleter returns them there
+		static void* operator new(const size_t size) { return TaskAllocator::allocate(size); }
+		static void operator delete(void* ptr, const size_t size) { TaskAllocator::deallocate(ptr, size); }
+
+		// over aligned tasks use the global allocator
+		static void* operator new(const size_t size, const align_val_t alignment) { return ::operator new(size, alignment); }
+		static void operator delete(void* ptr, const size_t size, const align_val_t alignment) { ::operator delete(ptr, size, alignment); }
+
+		JOBID get_id() { return m_jobid; }
+
+		// override this function for processing logic
+		virtual void process() = 0;
+
+	private:
+		friend class MultiTask;
+
+		const JOBID m_jobid;
+
+		// push time, set only when the conveyor collects latency
+		chrono::steady_clock::time_point m_pushed;
+	};
+
+	// task running a callable stored inline, the object size is the closure size plus the Task header,
+	// so small closures come from the TaskAllocator without any heap allocation of the captures
+	template<class F>
+	class FunctionTask final : public Task
+	{
+	public:
+		template<class Fn>
+		FunctionTask(JOBID jobid, Fn&& function) : Task(jobid), m_function(forward<Fn>(function)) {}
+
+		void process() override { m_function(); }
+
+	private:
+		F m_function;
+	};
+
+	// Chase-Lev work stealing deque: the owner pushes and pops at the bottom, other threads steal from the top
+	class WorkStealingDeque
+	{
+	public:
+		WorkStealingDeque(const size_t capacity = 256) : m_top(0), m_bottom(0)
+		{
+			size_t buffer_capacity = 1;
+			while (buffer_capacity < capacity)
+				buffer_capacity <<= 1;
+
+			m_buffers.push_back(make_unique<Buffer>(buffer_capacity));
+			m_buffer.store(m_buffers.back().get(), memory_order_relaxed);
+		}
+
+		~WorkStealingDeque()
+		{
+			clear();
+		}
+
+		WorkStealingDeque(const WorkStealingDeque&) = delete;
+		WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+		// owner only
+		void push(Task* task)
+		{
+			long long b = m_bottom.load(memory_order_relaxed);
+			long long t = m_top.load(memory_order_acquire);
+			Buffer* buffer = m_buffer.load(memory_order_relaxed);
+
+			if (b - t > static_cast<long long>(buffer->capacity) - 1)
+			{
+				// old buffers are kept alive until destruction because thieves may still read them
+				m_buffers.push_back(buffer->copy(buffer->capacity << 1, b, t));
+				buffer = m_buffers.back().get();
+				m_buffer.store(buffer, memory_order_release);
+			}
+
+			buffer->put(b, task);
+			m_bottom.store(b + 1, memory_order_release);
+		}
+
+		// owner only, returns the most recently pushed task
+		Task* pop()
+		{
+			long long b = m_bottom.load(memory_order_relaxed) - 1;
+			Buffer* buffer = m_buffer.load(memory_order_relaxed);
+			m_bottom.store(b, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+			long long t = m_top.load(memory_order_relaxed);
+
+			Task* task = nullptr;
+			if (t <= b)
+			{
+				task = buffer->get(b);
+				if (t == b)
+				{
+					// last task, race against thieves
+					if (!m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+						task = nullptr;
+					m_bottom.store(b + 1, memory_order_relaxed);
+				}
+			}
+			else
+				m_bottom.store(b + 1, memory_order_relaxed);
+
+			return task;
+		}
+
+		// any thread, returns the oldest task or nullptr if the deque is empty or the race was lost
+		Task* steal()
+		{
+			long long t = m_top.load(memory_order_acquire);
+			atomic_thread_fence(memory_order_seq_cst);
+			long long b = m_bottom.load(memory_order_acquire);
+
+			if (t >= b)
+				return nullptr;
+
+			Task* task = m_buffer.load(memory_order_acquire)->get(t);
+			if (!m_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+				return nullptr;
+
+			return task;
+		}
+
+		bool empty() const
+		{
+			return m_bottom.load(memory_order_relaxed) <= m_top.load(memory_order_relaxed);
+		}
+
+		// approximate if other threads use the deque
+		size_t size() const
+		{
+			return static_cast<size_t>(max(m_bottom.load(memory_order_relaxed) - m_top.load(memory_order_relaxed), 0ll));
+		}
+
+		// owner only, moves the tasks to a buffer allocated by the calling thread,
+		// a pinned owner gets it on its NUMA node, the old buffer is kept for thieves
+		void relocate()
+		{
+			const long long b = m_bottom.load(memory_order_relaxed);
+			const long long t = m_top.load(memory_order_acquire);
+			Buffer* buffer = m_buffer.load(memory_order_relaxed);
+
+			m_buffers.push_back(buffer->copy(buffer->capacity, b, t));
+			m_buffer.store(m_buffers.back().get(), memory_order_release);
+		}
+
+		// owner only, or when no other thread uses the deque
+		void clear()
+		{
+			while (Task* task = pop())
+				delete task;
+		}
+
+	private:
+		struct Buffer
+		{
+			Buffer(const size_t cap) : capacity(cap), mask(cap - 1), slots(make_unique<atomic<Task*>[]>(cap)) {}
+
+			Task* get(const long long i) { return slots[i & mask].load(memory_order_relaxed); }
+			void put(const long long i, Task* task) { slots[i & mask].store(task, memory_order_relaxed); }
+
+			unique_ptr<Buffer> copy(const size_t new_capacity, const long long b, const long long t)
+			{
+				auto buffer = make_unique<Buffer>(new_capacity);
+				for (long long i = t; i < b; ++i)
+					buffer->put(i, get(i));
+				return buffer;
+			}
+
+			const size_t capacity;
+			const size_t mask;
+			unique_ptr<atomic<Task*>[]> slots;
+		};
+
+		// thieves write m_top, the owner writes m_bottom
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED atomic<long long> m_top;
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED atomic<long long> m_bottom;
+		atomic<Buffer*> m_buffer;
+
+		// current buffer is the last one
+		vector<unique_ptr<Buffer>> m_buffers;
+	};
+
+	// Vyukov bounded multi producer multi consumer ring, capacity is rounded up to a power of two
+	class BoundedTaskRing
+	{
+	public:
+		BoundedTaskRing(const size_t capacity) : m_enqueue_pos(0), m_dequeue_pos(0)
+		{
+			size_t ring_capacity = 2;
+			while (ring_capacity < capacity)
+				ring_capacity <<= 1;
+
+			m_mask = ring_capacity - 1;
+			m_cells = make_unique<Cell[]>(ring_capacity);
+			for (size_t i = 0; i < ring_capacity; ++i)
+				m_cells[i].sequence.store(i, memory_order_relaxed);
+		}
+
+		~BoundedTaskRing()
+		{
+			clear();
+		}
+
+		BoundedTaskRing(const BoundedTaskRing&) = delete;
+		BoundedTaskRing& operator=(const BoundedTaskRing&) = delete;
+
+		// returns false if the ring is full
+		bool push(Task* task)
+		{
+			Cell* cell;
+			size_t pos = m_enqueue_pos.load(memory_order_relaxed);
+			while (1)
+			{
+				cell = &m_cells[pos & m_mask];
+				const size_t seq = cell->sequence.load(memory_order_acquire);
+				const auto dif = static_cast<long long>(seq) - static_cast<long long>(pos);
+
+				if (dif == 0)
+				{
+					if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false;
+				else
+					pos = m_enqueue_pos.load(memory_order_relaxed);
+			}
+
+			cell->task = task;
+			cell->sequence.store(pos + 1, memory_order_release);
+
+			return true;
+		}
+
+		// returns nullptr if the ring is empty
+		Task* pop()
+		{
+			Cell* cell;
+			size_t pos = m_dequeue_pos.load(memory_order_relaxed);
+			while (1)
+			{
+				cell = &m_cells[pos & m_mask];
+				const size_t seq = cell->sequence.load(memory_order_acquire);
+				const auto dif = static_cast<long long>(seq) - static_cast<long long>(pos + 1);
+
+				if (dif == 0)
+				{
+					if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return nullptr;
+				else
+					pos = m_dequeue_pos.load(memory_order_relaxed);
+			}
+
+			Task* task = cell->task;
+			cell->sequence.store(pos + m_mask + 1, memory_order_release);
+
+			return task;
+		}
+
+		// approximate while other threads push or pop
+		size_t size() const
+		{
+			const size_t dequeue_pos = m_dequeue_pos.load(memory_order_relaxed);
+			const size_t enqueue_pos = m_enqueue_pos.load(memory_order_relaxed);
+
+			return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+		}
+
+		bool empty() const { return size() == 0; }
+
+		size_t capacity() const { return m_mask + 1; }
+
+		unsigned long long pushed() const { return m_enqueue_pos.load(memory_order_relaxed); }
+		unsigned long long popped() const { return m_dequeue_pos.load(memory_order_relaxed); }
+
+		void clear()
+		{
+			while (Task* task = pop())
+				delete task;
+		}
+
+	private:
+		struct alignas(CACHE_LINE_SIZE) Cell
+		{
+			atomic_size_t sequence;
+			Task* task = nullptr;
+		};
+
+		unique_ptr<Cell[]> m_cells;
+		size_t m_mask;
+
+		// producers and consumers positions live on separate cache lines
+		alignas(CACHE_LINE_SIZE) atomic_size_t m_enqueue_pos;
+		alignas(CACHE_LINE_SIZE) atomic_size_t m_dequeue_pos;
+	};
+
+	// weighted round robin over priority lanes: a lane is served while it has credits, credits of all lanes
+	// are restored when every non empty lane has spent them, so a busy high lane can not starve lower ones
+	class LaneSelector
+	{
+	public:
+		static constexpr unsigned int LANE_WEIGHTS[PRIORITY_LANES] = { 8, 4, 1 };
+
+		LaneSelector() { refill(); }
+
+		// returns the lane to serve or PRIORITY_LANES if all lanes are empty
+		template<class NotEmpty>
+		size_t select(NotEmpty&& not_empty)
+		{
+			for (int pass = 0; pass < 2; ++pass)
+			{
+				for (size_t lane = 0; lane < PRIORITY_LANES; ++lane)
+					if (m_credits[lane] && not_empty(lane))
+					{
+						--m_credits[lane];
+						return lane;
+					}
+
+				refill();
+			}
+
+			return PRIORITY_LANES;
+		}
+
+		// the lane select() would return, no credit is spent
+		template<class NotEmpty>
+		size_t peek(NotEmpty&& not_empty) const
+		{
+			for (size_t lane = 0; lane < PRIORITY_LANES; ++lane)
+				if (m_credits[lane] && not_empty(lane))
+					return lane;
+
+			for (size_t lane = 0; lane < PRIORITY_LANES; ++lane)
+				if (not_empty(lane))
+					return lane;
+
+			return PRIORITY_LANES;
+		}
+
+	private:
+		void refill() { copy(begin(LANE_WEIGHTS), end(LANE_WEIGHTS), m_credits); }
+
+		unsigned int m_credits[PRIORITY_LANES];
+	};
+
+	// one priority lane of the shared queue, a FIFO per job served by deficit round robin,
+	// so a job pushing a lot of tasks can not starve the other jobs of the lane
+	class FairTaskLane
+	{
+	public:
+		void push(unique_ptr<Task>&& task)
+		{
+			const JOBID jobid = task->get_id();
+
+			JobTasks& job_tasks = job_queue(jobid);
+			if (job_tasks.tasks.empty())
+				m_active.push_back(jobid);
+
+			job_tasks.tasks.push_back(move(task));
+			++m_size;
+		}
+
+		// puts a popped task back, its job is served next
+		void push_front(unique_ptr<Task>&& task)
+		{
+			const JOBID jobid = task->get_id();
+
+			// a job with queued tasks may wait further back in the round robin, it moves to the front
+			JobTasks& job_tasks = job_queue(jobid);
+			if (job_tasks.tasks.empty())
+				m_active.push_front(jobid);
+			else if (m_active.front() != jobid)
+			{
+				m_active.erase(find(m_active.begin(), m_active.end(), jobid));
+				m_active.push_front(jobid);
+			}
+
+			job_tasks.tasks.push_front(move(task));
+			++m_size;
+		}
+
+		// not empty lane only
+		unique_ptr<Task> pop()
+		{
+			const JOBID jobid = m_active.front();
+			auto it = m_jobs.find(jobid);
+			JobTasks& job_tasks = it->second;
+
+			// the job turn starts with its weight of credits
+			if (job_tasks.deficit == 0)
+				job_tasks.deficit = jobid ? jobid->get_weight() : 1;
+
+			auto task = move(job_tasks.tasks.front());
+			job_tasks.tasks.pop_front();
+			--job_tasks.deficit;
+			--m_size;
+
+			if (job_tasks.tasks.empty())
+			{
+				// the drained queue keeps its memory for the next job
+				job_tasks.deficit = 0;
+				if (m_free.size() < MAX_FREE_QUEUES)
+					m_free.push_back(m_jobs.extract(it));
+				else
+					m_jobs.erase(it);
+
+				m_active.pop_front();
+			}
+			else if (job_tasks.deficit == 0)
+			{
+				m_active.pop_front();
+				m_active.push_back(jobid);
+			}
+
+			return task;
+		}
+
+		size_t size() const { return m_size; }
+
+		bool empty() const { return m_size == 0; }
+
+		void clear()
+		{
+			m_jobs.clear();
+			m_active.clear();
+			m_size = 0;
+		}
+
+	private:
+		struct JobTasks
+		{
+			deque<unique_ptr<Task>> tasks;
+			unsigned int deficit = 0;
+		};
+
+		using JobsMap = map<JOBID, JobTasks>;
+
+		// drained queues kept for reuse, so a shallow queue does not allocate per task
+		static constexpr size_t MAX_FREE_QUEUES = 16;
+
+		JobTasks& job_queue(const JOBID jobid)
+		{
+			if (auto it = m_jobs.find(jobid); it != m_jobs.end())
+				return it->second;
+
+			if (m_free.empty())
+				return m_jobs[jobid];
+
+			auto node = move(m_free.back());
+			m_free.pop_back();
+
+			node.key() = jobid;
+			return m_jobs.insert(move(node)).position->second;
+		}
+
+		JobsMap m_jobs;
+		vector<JobsMap::node_type> m_free;
+
+		// jobs with tasks in round robin order
+		deque<JOBID> m_active;
+
+		size_t m_size = 0;
+	};
+
+	// shared tasks queue with one fair lane per priority, not thread safe, MultiTask guards it with its mutex
+	class PriorityTaskQueue
+	{
+	public:
+		void push(unique_ptr<Task>&& task, const TaskPriority priority)
+		{
+			const size_t lane = static_cast<size_t>(priority);
+
+			m_lanes[lane].push(move(task));
+			++m_size;
+
+			LaneMetrics& metrics = m_metrics[lane];
+			++metrics.pushed;
+			metrics.max_depth = max(metrics.max_depth, m_lanes[lane].size());
+		}
+
+		// puts a popped task back at the front of its lane
+		void push_front(unique_ptr<Task>&& task, const TaskPriority priority)
+		{
+			const size_t lane = static_cast<size_t>(priority);
+
+			m_lanes[lane].push_front(move(task));
+			++m_size;
+
+			--m_metrics[lane].popped;
+		}
+
+		unique_ptr<Task> pop()
+		{
+			const size_t lane = m_selector.select([this](const size_t l) {return !m_lanes[l].empty(); });
+			if (lane == PRIORITY_LANES)
+				return {};
+
+			auto task = m_lanes[lane].pop();
+			--m_size;
+
+			++m_metrics[lane].popped;
+
+			return task;
+		}
+
+		// the lane pop() would serve, PRIORITY_LANES if empty
+		size_t next_lane() const { return m_selector.peek([this](const size_t l) {return !m_lanes[l].empty(); }); }
+
+		size_t size() const { return m_size; }
+
+		size_t lane_size(const TaskPriority priority) const { return m_lanes[static_cast<size_t>(priority)].size(); }
+
+		LaneMetrics metrics(const TaskPriority priority) const
+		{
+			LaneMetrics metrics = m_metrics[static_cast<size_t>(priority)];
+			metrics.depth = lane_size(priority);
+			return metrics;
+		}
+
+		void clear()
+		{
+			for (auto& lane : m_lanes)
+				lane.clear();
+
+			m_size = 0;
+		}
+
+	private:
+		FairTaskLane m_lanes[PRIORITY_LANES];
+		LaneMetrics m_metrics[PRIORITY_LANES];
+		LaneSelector m_selector;
+		size_t m_size = 0;
+	};
+
+	// futex style parking spot of one thread, unpark() before park() is not lost
+	class Parker
+	{
+	public:
+		void park()
+		{
+			unsigned int state = NOTIFIED;
+			if (m_state.compare_exchange_strong(state, EMPTY, memory_order_acquire))
+				return;
+
+			// state is EMPTY here unless unpark() came in between
+			if (!m_state.compare_exchange_strong(state, PARKED, memory_order_acquire))
+			{
+				m_state.store(EMPTY, memory_order_relaxed);
+				return;
+			}
+
+			while (m_state.load(memory_order_acquire) == PARKED)
+				m_state.wait(PARKED, memory_order_acquire);
+
+			m_state.store(EMPTY, memory_order_relaxed);
+		}
+
+		// atomic wait has no timeout, a timed park sleeps on the condition variable, returns false on timeout
+		template<class Rep, class Period>
+		bool park_for(const chrono::duration<Rep, Period>& timeout)
+		{
+			unsigned int state = NOTIFIED;
+			if (m_state.compare_exchange_strong(state, EMPTY, memory_order_acquire))
+				return true;
+
+			unique_lock lk(m_mutex);
+
+			if (!m_state.compare_exchange_strong(state, PARKED_TIMED, memory_order_acquire))
+			{
+				m_state.store(EMPTY, memory_order_relaxed);
+				return true;
+			}
+
+			if (!m_cv.wait_for(lk, timeout, [this]() {return m_state.load(memory_order_acquire) != PARKED_TIMED; }))
+			{
+				// unpark() coming right now wins
+				state = PARKED_TIMED;
+				if (m_state.compare_exchange_strong(state, EMPTY, memory_order_acquire))
+					return false;
+			}
+
+			m_state.store(EMPTY, memory_order_relaxed);
+			return true;
+		}
+
+		void unpark()
+		{
+			// the futex call is needed only if the thread really sleeps
+			const unsigned int state = m_state.exchange(NOTIFIED, memory_order_release);
+			if (state == PARKED)
+				m_state.notify_one();
+			else if (state == PARKED_TIMED)
+			{
+				lock_guard lk(m_mutex);
+				m_cv.notify_one();
+			}
+		}
+
+	private:
+		static constexpr unsigned int EMPTY = 0;
+		static constexpr unsigned int PARKED = 1;
+		static constexpr unsigned int NOTIFIED = 2;
+		static constexpr unsigned int PARKED_TIMED = 3;
+
+		atomic_uint m_state{ EMPTY };
+
+		// timed park only
+		mutex m_mutex;
+		condition_variable m_cv;
+	};
+
+	class MultiTask
+	{
+	public:
+		MultiTask(const unsigned int task_threads = 0, const unsigned int max_tasks = 0)
+		{
+			init(task_threads, max_tasks);
+		}
+
+		MultiTask(const MultiTaskOptions& options)
+		{
+			init(options);
+		}
+
+		~MultiTask()
+		{
+			terminate();
+		}
+
+		void init(const unsigned int task_threads, const unsigned int max_tasks)
+		{
+			MultiTaskOptions options;
+			options.task_threads = task_threads;
+			options.max_tasks = max_tasks;
+
+			init(options);
+		}
+
+		// a running conveyor is not initialized again, init() after terminate() starts it with the new options,
+		// throws logic_error otherwise
+		void init(const MultiTaskOptions& options)
+		{
+			if (!m_workers.empty())
+				throw logic_error("MultiTask::init() called while running, terminate() first");
+
+			m_max_tasks = options.max_tasks;
+			m_scheduler = options.scheduler;
+			m_max_batch_size = max(options.max_batch_size, 1u);
+			m_max_job_threads = options.job_threads ? options.job_threads : max(thread::hardware_concurrency(), 1u);
+			m_jobs_stop = false;
+			m_stop = false;
+
+			if (m_scheduler == SchedulerMode::lock_free_ring)
+				for (size_t lane = 0; lane < PRIORITY_LANES; ++lane)
+				{
+					m_rings[lane] = make_unique<BoundedTaskRing>(m_max_tasks ? m_max_tasks : DEFAULT_RING_CAPACITY);
+					m_ring_max_depth[lane] = 0;
+				}
+
+			// one shared queue per NUMA node
+			const vector<vector<unsigned int>> nodes = options.numa_aware ? read_numa_nodes(options.numa_sysfs_path) : vector<vector<unsigned int>>();
+
+			m_queues.clear();
+			m_cpu_nodes.clear();
+			for (size_t node = 0; node < max<size_t>(nodes.size(), 1); ++node)
+				m_queues.push_back(make_unique<SharedQueue>());
+
+			for (size_t node = 0; node < nodes.size(); ++node)
+				for (const unsigned int cpu : nodes[node])
+				{
+					if (cpu >= m_cpu_nodes.size())
+						m_cpu_nodes.resize(cpu + 1, 0);
+
+					m_cpu_nodes[cpu] = static_cast<unsigned int>(node);
+				}
+
+			int task_threads_count = (options.task_threads == 0 ? thread::hardware_concurrency() - 1 : options.task_threads);
+			if (!task_threads_count)
+				++task_threads_count;
+
+			m_thread_name = options.thread_name;
+			m_sched_policy = options.sched_policy;
+			m_sched_priority = options.sched_priority;
+			m_nice = options.nice;
+
+			// all elastic pool workers exist from the start, only their threads come and go
+			m_min_workers = static_cast<unsigned int>(task_threads_count);
+			m_active_workers = m_min_workers;
+			m_grow_queue_depth = max(options.grow_queue_depth, 1u);
+			m_idle_timeout = chrono::milliseconds(options.idle_timeout_ms);
+
+			const int workers_count = max(task_threads_count, static_cast<int>(options.max_task_threads));
+
+			m_idle_spin = static_cast<unsigned int>(workers_count) < thread::hardware_concurrency() ? chrono::microseconds(options.idle_spin_us) : chrono::microseconds(0);
+			m_idle_yield = chrono::microseconds(options.idle_yield_us);
+			m_adaptive_idle = options.adaptive_idle;
+			m_collect_latency = options.collect_latency;
+
+			m_stats_time = chrono::steady_clock::now();
+			m_stats_pushed = 0;
+			m_stats_completed = 0;
+
+			// workers init, all deques must exist before any thread starts stealing
+			m_workers.reserve(workers_count);
+			m_idle_workers.reserve(workers_count);
+			for (int i = 0; i < workers_count; ++i)
+			{
+				auto worker = make_unique<Worker>(this, i);
+				worker->idle_gap = m_idle_spin + m_idle_yield;
+
+				if (!options.worker_cpus.empty())
+				{
+					// explicit cpus, the node of the first one is the worker node
+					worker->cpus = options.worker_cpus[i % options.worker_cpus.size()];
+					if (!worker->cpus.empty() && worker->cpus[0] < m_cpu_nodes.size())
+						worker->node = m_cpu_nodes[worker->cpus[0]];
+				}
+				else if (!nodes.empty())
+				{
+					// workers are spread over the nodes round robin, then over the node cpus
+					worker->node = static_cast<unsigned int>(i % nodes.size());
+
+					const vector<unsigned int>& cpus = nodes[worker->node];
+					worker->cpus = { cpus[(i / nodes.size()) % cpus.size()] };
+				}
+
+				m_workers.push_back(move(worker));
+			}
+
+			for (unsigned int i = 0; i < m_min_workers; ++i)
+			{
+				m_workers[i]->running = true;
+				m_workers[i]->worker_thread = thread(&MultiTask::process_task, this, i);
+			}
+		}
+
+		void terminate()
+		{
+			// not started jobs are cancelled, running jobs still need workers to complete
+			m_jobs_queue_mutex.lock();
+
+			deque<Job*> cancelled;
+			cancelled.swap(m_jobs_queue);
+			m_jobs_stop = true;
+
+			m_jobs_queue_mutex.unlock();
+
+			m_new_job_cv.notify_all();
+
+			for (Job* job : cancelled)
+				job->cancel();
+
+			for (auto& t : m_job_threads)
+				t.join();
+
+			m_job_threads.clear();
+			m_retired_job_threads.clear();
+
+			// producers blocked on max_tasks check m_stop under their queue mutex
+			vector<unique_ptr<Task>> dropped;
+			for (auto& queue : m_queues)
+			{
+				queue->queue_mutex.lock();
+
+				while (queue->tasks.size())
+					dropped.push_back(queue->tasks.pop());
+
+				queue->update_sizes();
+			}
+
+			m_stop = true;
+
+			for (auto& queue : m_queues)
+			{
+				queue->queue_mutex.unlock();
+				queue->task_done.notify_all();
+			}
+
+			// workers waiting in parallel_for() for the dropped tasks go on
+			for (auto& task : dropped)
+				drop_task(move(task));
+
+			// no worker is started after this
+			{
+				lock_guard lk(m_pool_mutex);
+			}
+
+			for (auto& w : m_workers)
+				w->parker.unpark();
+
+			// release producers waiting for a free ring cell
+			++m_ring_pops;
+			m_ring_pops.notify_all();
+
+			for (auto& w : m_workers)
+				if (w->worker_thread.joinable())
+					w->worker_thread.join();
+
+			drop_left_tasks();
+
+			m_workers.clear();
+			for (auto& ring : m_rings)
+				ring.reset();
+
+			m_idle_workers.clear();
+			m_idle_count = 0;
+		}
+
+		SchedulerMode get_scheduler() { return m_scheduler; }
+
+		// NUMA nodes with their own shared queue, 1 unless numa_aware found several nodes with cpus
+		size_t get_node_count() { return m_queues.size(); }
+
+		// workers running now, changes in the elastic pool only
+		unsigned int get_worker_count() { return m_active_workers.load(memory_order_relaxed); }
+
+		// latency histograms collected so far, empty unless collect_latency is set,
+		// tasks run by non worker threads (parallel_for callers) are not counted
+		LatencySnapshot latency_snapshot()
+		{
+			LatencySnapshot snapshot;
+			snapshot.workers.resize(m_workers.size());
+
+			// the newest job at every address
+			map<JOBID, unsigned long long> serials;
+
+			for (auto& w : m_workers)
+			{
+				lock_guard lk(w->latency_mutex);
+
+				snapshot.workers[w->index].merge(w->retired_latency);
+
+				for (const auto& [jobid, job] : w->latency)
+				{
+					snapshot.workers[w->index].merge(job.latency);
+
+					auto [serial, is_new] = serials.try_emplace(jobid, job.serial);
+					if (job.serial > serial->second)
+					{
+						serial->second = job.serial;
+						snapshot.jobs[jobid] = TaskLatency();
+					}
+
+					if (job.serial == serial->second)
+						snapshot.jobs[jobid].merge(job.latency);
+				}
+			}
+
+			for (const TaskLatency& latency : snapshot.workers)
+				snapshot.total.merge(latency);
+
+			return snapshot;
+		}
+
+		void reset_latency()
+		{
+			for (auto& w : m_workers)
+			{
+				lock_guard lk(w->latency_mutex);
+				w->latency.clear();
+				w->retired_latency = TaskLatency();
+			}
+		}
+
+		// live counters, cheap enough to poll for autoscaling decisions
+		MultiTaskStats stats()
+		{
+			MultiTaskStats stats;
+
+			const long long now = now_ns();
+
+			stats.tasks_pushed = m_external_pushed.load(memory_order_relaxed);
+
+			{
+				lock_guard lk(m_pool_mutex);
+
+				stats.workers.resize(m_workers.size());
+				for (auto& w : m_workers)
+				{
+					WorkerStats& ws = stats.workers[w->index];
+
+					stats.tasks_pushed += w->tasks_pushed.load(memory_order_relaxed);
+					ws.tasks_completed = w->tasks_completed.load(memory_order_relaxed);
+					stats.tasks_completed += ws.tasks_completed;
+
+					stats.queue_depth += w->deque.size() + w->batch_size.load(memory_order_relaxed);
+
+					ws.running = w->running;
+					ws.affinity_failed = w->affinity_failed.load(memory_order_relaxed);
+					ws.scheduling_failed = w->scheduling_failed.load(memory_order_relaxed);
+					const long long started = w->started_ns.load(memory_order_relaxed);
+					const long long stopped = w->stopped_ns.load(memory_order_relaxed);
+					if (!started)
+						continue;
+
+					const long long idle_since = w->idle_since_ns.load(memory_order_relaxed);
+					const long long parked = w->parked_ns.load(memory_order_relaxed);
+					const long long idle = w->idle_ns.load(memory_order_relaxed) + (idle_since && !stopped ? now - idle_since : 0);
+					const long long total = (stopped ? stopped : now) - started;
+
+					ws.parked = chrono::nanoseconds(parked);
+					ws.idle = chrono::nanoseconds(max(idle - parked, 0ll));
+					ws.busy = chrono::nanoseconds(max(total - idle, 0ll));
+				}
+
+				stats.workers_running = m_active_workers.load(memory_order_relaxed);
+			}
+
+			for (auto& queue : m_queues)
+			{
+				stats.queue_depth += queue->size.load(memory_order_relaxed);
+				stats.max_queue_depth += queue->max_size.load(memory_order_relaxed);
+			}
+
+			for (size_t lane = 0; lane < PRIORITY_LANES; ++lane)
+				if (m_rings[lane])
+				{
+					stats.queue_depth += m_rings[lane]->size();
+					stats.max_queue_depth += m_ring_max_depth[lane].load(memory_order_relaxed);
+				}
+
+			stats.backpressure_stalls = m_stalls.load(memory_order_relaxed);
+			stats.backpressure_time = chrono::nanoseconds(m_stall_ns.load(memory_order_relaxed));
+
+			{
+				lock_guard lk(m_job_map_mutex);
+				stats.jobs = m_jobs_map.size();
+			}
+
+			lock_guard lk(m_stats_mutex);
+
+			const auto stats_time = chrono::steady_clock::now();
+			if (const double seconds = chrono::duration<double>(stats_time - m_stats_time).count(); seconds > 0)
+			{
+				stats.pushed_per_second = (stats.tasks_pushed - m_stats_pushed) / seconds;
+				stats.completed_per_second = (stats.tasks_completed - m_stats_completed) / seconds;
+			}
+
+			m_stats_time = stats_time;
+			m_stats_pushed = stats.tasks_pushed;
+			m_stats_completed = stats.tasks_completed;
+
+			return stats;
+		}
+
+		// depth metrics of the shared queue lane summed over the node queues, or of the ring of the priority in ring mode
+		LaneMetrics lane_metrics(const TaskPriority priority)
+		{
+			const size_t lane = static_cast<size_t>(priority);
+
+			if (m_scheduler == SchedulerMode::lock_free_ring)
+			{
+				LaneMetrics metrics;
+				metrics.depth = m_rings[lane]->size();
+				metrics.max_depth = m_ring_max_depth[lane].load(memory_order_relaxed);
+				metrics.pushed = m_rings[lane]->pushed();
+				metrics.popped = m_rings[lane]->popped();
+				return metrics;
+			}
+
+			LaneMetrics metrics;
+			for (auto& queue : m_queues)
+			{
+				lock_guard lk(queue->queue_mutex);
+				const LaneMetrics node_metrics = queue->tasks.metrics(priority);
+
+				metrics.depth += node_metrics.depth;
+				metrics.max_depth = max(metrics.max_depth, node_metrics.max_depth);
+				metrics.pushed += node_metrics.pushed;
+				metrics.popped += node_metrics.popped;
+			}
+
+			return metrics;
+		}
+
+		// tasks functions
+		// the task gets the priority of its job
+		template<derived_from<Task> T>
+		void push_task(unique_ptr<T>&& task)
+		{
+			const TaskPriority priority = task_priority(task.get());
+			push_task<T>(forward<unique_ptr<T>>(task), priority);
+		}
+
+		template<derived_from<Task> T>
+		void push_task(unique_ptr<T>&& task, const TaskPriority priority)
+		{
+			if (m_collect_latency)
+				task->m_pushed = chrono::steady_clock::now();
+
+			if constexpr (Trace::enabled)
+				Trace::instant("push", reinterpret_cast<unsigned long long>(task->get_id()));
+
+			count_pushed(1);
+
+			if (m_scheduler == SchedulerMode::lock_free_ring)
+			{
+				push_ring(task.release(), priority);
+				return;
+			}
+
+			// normal tasks pushed from a worker go to its own deque and never block on max_tasks,
+			// other priorities go to the shared queue lanes
+			if (m_scheduler == SchedulerMode::work_stealing && priority == TaskPriority::normal)
+				if (Worker* worker = current_worker())
+				{
+					if (JOBID jobid = task->get_id())
+						count_job_tasks(jobid, 1);
+
+					worker->deque.push(task.release());
+
+					wake_worker();
+					return;
+				}
+
+			SharedQueue& queue = push_queue();
+			unique_lock lk(queue.queue_mutex);
+
+			if (m_max_tasks && queue.tasks.size() >= m_max_tasks)
+				wait_for_room(queue, lk);
+
+			if (JOBID jobid = task->get_id())
+				count_job_tasks(jobid, 1);
+
+			queue.tasks.push(forward<unique_ptr<T>>(task), priority);
+			queue.update_sizes();
+
+			lk.unlock();
+
+			wake_worker();
+		}
+
+		template<derived_from<Task> T, class... Args>
+		void emplace_task(Args&& ...args)
+		{
+			push_task<T>(forward<unique_ptr<T>>(make_unique<T>(forward<Args>(args)...)));
+		}
+
+		template<derived_from<Task> T, class... Args>
+		void emplace_task(const TaskPriority priority, Args&& ...args)
+		{
+			push_task<T>(forward<unique_ptr<T>>(make_unique<T>(forward<Args>(args)...)), priority);
+		}
+
+		// co_await schedule() continues the coroutine on a worker
+		class ScheduleAwaiter
+		{
+		public:
+			ScheduleAwaiter(MultiTask& conveyor) : m_conveyor(conveyor) {}
+
+			bool await_ready() { return false; }
+			void await_suspend(coroutine_handle<> handle) { m_conveyor.submit(nullptr, [handle]() {handle.resume(); }); }
+			void await_resume() {}
+
+		private:
+			MultiTask& m_conveyor;
+		};
+
+		ScheduleAwaiter schedule() { return ScheduleAwaiter(*this); }
+
+		// co_await when_all(f1, f2, ...) runs the callables as tasks and continues the coroutine
+		// on the worker completing the last of them
+		template<class... F>
+		class WhenAllAwaiter
+		{
+		public:
+			template<class... Fn>
+			WhenAllAwaiter(MultiTask& conveyor, Fn&& ...functions) : m_conveyor(conveyor), m_functions(forward<Fn>(functions)...) {}
+
+			bool await_ready() { return sizeof...(F) == 0; }
+
+			bool await_suspend(coroutine_handle<> handle)
+			{
+				apply([this](F& ...functions) {(m_conveyor.submit(m_job.get_id(), move(functions)), ...); }, m_functions);
+
+				m_job.set_all_tasks_pushed();
+
+				// false if all tasks are already done, the coroutine goes on without suspending
+				m_awaiter.emplace(m_job);
+				return m_awaiter->await_suspend(handle);
+			}
+
+			void await_resume() {}
+
+		private:
+			class WhenAllJob final : public Job
+			{
+			public:
+				void process() override {}
+				void process_after_done() override {}
+			};
+
+			MultiTask& m_conveyor;
+			tuple<F...> m_functions;
+			WhenAllJob m_job;
+			optional<Job::Awaiter> m_awaiter;
+		};
+
+		template<class... F>
+			requires (invocable<decay_t<F>&> && ...)
+		WhenAllAwaiter<decay_t<F>...> when_all(F&& ...functions)
+		{
+			return WhenAllAwaiter<decay_t<F>...>(*this, forward<F>(functions)...);
+		}
+
+		// pushes a callable as a task of the job
+		template<class F>
+			requires invocable<decay_t<F>&>
+		void submit(const JOBID jobid, F&& function)
+		{
+			push_task(make_unique<FunctionTask<decay_t<F>>>(jobid, forward<F>(function)));
+		}
+
+		// calls function(i) for every i in [begin, end) and returns when all calls are done,
+		// the range is split recursively until parts are not longer than grain (0 - automatic),
+		// the calling thread processes the first part itself
+		template<integral Index, class F>
+			requires invocable<F&, Index>
+		void parallel_for(const Index begin, const Index end, const Index grain, F&& function)
+		{
+			if (begin >= end)
+				return;
+
+			RangeJob job;
+			job.set_conveyor(this);
+
+			auto body = [&function](Index first, const Index last) {
+				for (; first < last; ++first)
+					function(first);
+				};
+
+			split_range(job.get_id(), begin, end, range_grain(begin, end, grain), body);
+
+			wait_range_job(job);
+		}
+
+		// returns reduce(...reduce(identity, map(begin))..., map(end - 1)) computed in parallel,
+		// reduce must be associative and commutative because every worker accumulates its own partial result
+		template<integral Index, class T, class Map, class Reduce>
+			requires invocable<Map&, Index> && invocable<Reduce&, T, invoke_result_t<Map&, Index>>
+		T parallel_reduce(const Index begin, const Index end, const T& identity, Map&& map, Reduce&& reduce)
+		{
+			if (begin >= end)
+				return identity;
+
+			struct alignas(CACHE_LINE_SIZE) Partial
+			{
+				T value;
+			};
+
+			// one partial per worker and the last one for the calling thread
+			vector<Partial> partials(m_workers.size() + 1, Partial{ identity });
+
+			RangeJob job;
+			job.set_conveyor(this);
+
+			auto body = [&](Index first, const Index last) {
+				T local = identity;
+				for (; first < last; ++first)
+					local = reduce(move(local), map(first));
+
+				// a worker runs one leaf at a time, the only other thread running leaves is the caller
+				Worker* worker = current_worker();
+				T& partial = partials[worker ? worker->index : partials.size() - 1].value;
+				partial = reduce(move(partial), move(local));
+				};
+
+			split_range(job.get_id(), begin, end, range_grain(begin, end, Index(0)), body);
+
+			wait_range_job(job);
+
+			// tree reduction of the partial results
+			for (size_t step = 1; step < partials.size(); step *= 2)
+				for (size_t i = 0; i + step < partials.size(); i += 2 * step)
+					partials[i].value = reduce(move(partials[i].value), move(partials[i + step].value));
+
+			return move(partials[0].value);
+		}
+
+		// pushes the whole range with one queue lock and one counter update per job, tasks are moved out of the range
+		template<ranges::input_range R>
+			requires derived_from<typename ranges::range_value_t<R>::element_type, Task>
+		void push_tasks(R&& tasks)
+		{
+			vector<unique_ptr<Task>> batch;
+			if constexpr (ranges::sized_range<R>)
+				batch.reserve(ranges::size(tasks));
+
+			for (auto&& task : tasks)
+				batch.push_back(move(task));
+
+			push_batch(batch);
+		}
+
+		// generator(i) returns unique_ptr to the i-th task
+		template<class F>
+			requires derived_from<typename invoke_result_t<F&, size_t>::element_type, Task>
+		void push_tasks(const size_t count, F&& generator)
+		{
+			vector<unique_ptr<Task>> batch;
+			batch.reserve(count);
+
+			for (size_t i = 0; i < count; ++i)
+				batch.push_back(generator(i));
+
+			push_batch(batch);
+		}
+
+		// args_generator(i) returns a tuple of the i-th task constructor arguments
+		template<derived_from<Task> T, class F>
+		void emplace_tasks(const size_t count, F&& args_generator)
+		{
+			push_tasks(count, [&args_generator](const size_t i) {
+				return apply([](auto&& ...args) {return make_unique<T>(forward<decltype(args)>(args)...); }, args_generator(i));
+				});
+		}
+
+		// jobs functions
+		template<derived_from<Job> T>
+		T* push_job(unique_ptr<T>&& job, const TaskPriority priority)
+		{
+			job->set_priority(priority);
+			return push_job<T>(forward<unique_ptr<T>>(job));
+		}
+
+		template<derived_from<Job> T>
+		T* push_job(unique_ptr<T>&& job)
+		{
+			auto job_ptr = job.get();
+
+			JOBID jobid = static_cast<JOBID>(job_ptr);
+			job->set_conveyor(this);
+
+			unique_lock ul(m_job_map_mutex);
+			if (auto [new_obj_itt, is_success] = m_jobs_map.try_emplace(jobid, forward<unique_ptr<T>>(job)); !is_success)
+				return job_ptr;
+
+			ul.unlock();
+
+			start_job(job_ptr);
+
+			return job_ptr;
+		}
+
+		template<derived_from<Job> T, class... Args>
+		T* emplace_job(Args&& ...args)
+		{
+			return push_job<T>(forward<unique_ptr<T>>(make_unique<T>(forward<Args>(args)...)));
+		}
+
+		auto pop_job(const JOBID jobid)
+		{
+			unique_lock ul(m_job_map_mutex);
+			auto node = m_jobs_map.extract(jobid);
+
+			if (node.empty())
+				return unique_ptr<remove_pointer_t<decltype(jobid)>>{};
+			else
+				return unique_ptr<remove_pointer_t<decltype(jobid)>>(static_cast<decltype(jobid)>(node.mapped().release()));
+		}
+
+		void restart_job(const JOBID jobid)
+		{
+			if (jobid == nullptr)
+				return;
+
+			jobid->reset();
+
+			start_job(jobid);
+		}
+
+		bool check_job_is_done(const JOBID jobid)
+		{
+			if (jobid == nullptr)
+				return true;
+
+			return jobid->is_done();
+		}
+
+		void wait_job_done(const JOBID jobid)
+		{
+			if (jobid == nullptr)
+				return;
+
+			// the worker may hold completions of the job or its tasks
+			if (Worker* worker = current_worker())
+			{
+				flush_completed(*worker);
+
+				if (!jobid->is_done())
+					return_batch(*worker);
+			}
+
+			// a job thread waiting for a job it started must not keep that job from a thread
+			if (t_job_conveyor == this && !jobid->is_done())
+			{
+				unique_lock lk(m_jobs_queue_mutex);
+
+				++m_blocked_job_threads;
+				const bool start_thread = need_job_thread();
+				if (start_thread)
+					start_job_thread();
+
+				lk.unlock();
+
+				if (!start_thread)
+					m_new_job_cv.notify_one();
+
+				jobid->wait_until_done();
+
+				lk.lock();
+				--m_blocked_job_threads;
+
+				return;
+			}
+
+			jobid->wait_until_done();
+		}
+
+		void process_task(const unsigned int worker_index)
+		{
+			Worker& worker = *m_workers[worker_index];
+			t_current_worker = &worker;
+
+			// pinned before the first task
+			apply_thread_options(worker);
+
+			// with NUMA placement the tasks pushed by the worker and its deque come from its node memory,
+			// the deque is moved once, the first thread of an elastic worker places it
+			if (m_queues.size() > 1)
+			{
+				TaskAllocator::set_thread_node(worker.node);
+
+				if (!worker.deque_relocated)
+				{
+					worker.deque.relocate();
+					worker.deque_relocated = true;
+				}
+			}
+
+			worker.idle_ns.store(0, memory_order_relaxed);
+			worker.parked_ns.store(0, memory_order_relaxed);
+			worker.idle_since_ns.store(0, memory_order_relaxed);
+			worker.stopped_ns.store(0, memory_order_relaxed);
+			worker.started_ns.store(now_ns(), memory_order_relaxed);
+
+			if constexpr (Trace::enabled)
+				Trace::set_thread_name("worker " + to_string(worker.index));
+
+			while (1)
+			{
+				auto task = next_task(worker);
+
+				// empty task means terminate
+				if (task.get() == nullptr)
+					break;
+
+				run_task(worker, move(task));
+			}
+
+			// at terminate the tasks left to this worker are dropped now, other workers may wait for their jobs,
+			// dropping completes jobs that may push more tasks to the deque
+			for (auto& task : worker.batch)
+				drop_task(move(task));
+
+			worker.batch.clear();
+
+			while (Task* task = worker.deque.pop())
+				drop_task(unique_ptr<Task>(task));
+
+			flush_completed(worker);
+
+			worker.stopped_ns.store(now_ns(), memory_order_relaxed);
+
+			t_current_worker = nullptr;
+		}
+
+		// the job thread is free as soon as all tasks are pushed, the job is completed by the last task
+		void process_job(Job* job)
+		{
+			if constexpr (Trace::enabled)
+			{
+				const long long start = Trace::now();
+				job->process();
+				Trace::complete("job process", reinterpret_cast<unsigned long long>(job), start);
+			}
+			else
+				job->process();
+
+			job->set_all_tasks_pushed();
+		}
+
+	private:
+
+		// queues the job for the job threads, starts a new one if all are busy
+		void start_job(Job* job)
+		{
+			unique_lock lk(m_jobs_queue_mutex);
+
+			if (m_jobs_stop)
+			{
+				lk.unlock();
+				job->cancel();
+				return;
+			}
+
+			m_jobs_queue.push_back(job);
+
+			if (need_job_thread())
+				start_job_thread();
+			else
+			{
+				lk.unlock();
+				m_new_job_cv.notify_one();
+			}
+		}
+
+		// job threads not blocked in wait_job_done(), called under m_jobs_queue_mutex
+		size_t active_job_threads()
+		{
+			return m_job_threads.size() - m_retired_job_threads.size() - m_blocked_job_threads;
+		}
+
+		// called under m_jobs_queue_mutex
+		bool need_job_thread()
+		{
+			return m_jobs_queue.size() > m_idle_job_threads && active_job_threads() < m_max_job_threads;
+		}
+
+		// called under m_jobs_queue_mutex, reuses the place of a retired thread
+		void start_job_thread()
+		{
+			if (m_retired_job_threads.empty())
+			{
+				m_job_threads.emplace_back(&MultiTask::process_jobs, this, m_job_threads.size());
+				return;
+			}
+
+			const size_t index = m_retired_job_threads.back();
+			m_retired_job_threads.pop_back();
+
+			// the retired thread is already out of its loop
+			m_job_threads[index].join();
+			m_job_threads[index] = thread(&MultiTask::process_jobs, this, index);
+		}
+
+		void process_jobs(const size_t index)
+		{
+			t_job_conveyor = this;
+
+			if constexpr (Trace::enabled)
+				Trace::set_thread_name("job thread");
+
+			unique_lock lk(m_jobs_queue_mutex);
+
+			const auto has_job = [this]() {return m_jobs_stop || m_jobs_queue.size() > 0; };
+
+			while (1)
+			{
+				++m_idle_job_threads;
+
+				// threads over m_max_job_threads were started for blocked ones, they retire when idle long enough
+				if (active_job_threads() > m_max_job_threads)
+				{
+					if (!m_new_job_cv.wait_for(lk, m_idle_timeout, has_job) && active_job_threads() > m_max_job_threads)
+					{
+						--m_idle_job_threads;
+						m_retired_job_threads.push_back(index);
+						return;
+					}
+				}
+				else
+					m_new_job_cv.wait(lk, has_job);
+
+				--m_idle_job_threads;
+
+				if (m_jobs_stop)
+					break;
+
+				if (m_jobs_queue.empty())
+					continue;
+
+				Job* job = m_jobs_queue.front();
+				m_jobs_queue.pop_front();
+
+				lk.unlock();
+
+				process_job(job);
+
+				lk.lock();
+			}
+		}
+
+		// owner of the tasks of parallel_for and parallel_reduce
+		class RangeJob final : public Job
+		{
+		public:
+			void process() override {}
+			void process_after_done() override {}
+		};
+
+		template<integral Index>
+		Index range_grain(const Index begin, const Index end, const Index grain)
+		{
+			if (grain > 0)
+				return grain;
+
+			// about 8 parts per worker leaves room for load balancing
+			return max<Index>(Index(1), static_cast<Index>((end - begin) / (8 * get_worker_count())));
+		}
+
+		// keeps the left half and pushes the right half, so idle workers take the biggest parts first
+		template<integral Index, class Body>
+		void split_range(const JOBID jobid, Index begin, Index end, const Index grain, const Body& body)
+		{
+			// deep in nested helping the range runs here, waiting for pushed parts would help with more tasks
+			if (Worker* worker = current_worker(); worker && worker->help_depth >= MAX_HELP_DEPTH)
+			{
+				body(begin, end);
+				return;
+			}
+
+			while (end - begin > grain)
+			{
+				const Index middle = begin + (end - begin) / 2;
+
+				submit(jobid, [this, jobid, middle, end, grain, &body]() {
+					split_range(jobid, middle, end, grain, body);
+					});
+
+				end = middle;
+			}
+
+			body(begin, end);
+		}
+
+		void wait_range_job(Job& job)
+		{
+			job.set_all_tasks_pushed();
+
+			// too deep split_range() pushed nothing, the job is already done
+			if (Worker* worker = current_worker(); worker && worker->help_depth < MAX_HELP_DEPTH)
+				help_until(*worker, [&job]() {return job.is_done(); });
+
+			job.wait_until_done();
+		}
+
+		// latency of the tasks of one job run by one worker
+		struct JobLatency
+		{
+			unsigned long long serial = 0;
+			TaskLatency latency;
+		};
+
+		// jobs a worker keeps latency for, about 8 KB each
+		static constexpr size_t MAX_LATENCY_JOBS = 64;
+
+		// completions a worker holds before taking them off the job running count, see run_task()
+		static constexpr unsigned long MAX_HELD_COMPLETIONS = 64;
+
+		// nested help_until() calls of a worker, deeper pushes to a full ring or shared queue don't help anymore
+		// and parallel_for() runs the whole range in the calling task, see push_ring(), wait_for_room() and split_range()
+		static constexpr unsigned int MAX_HELP_DEPTH = 16;
+
+		// local deque pops in a row while the node shared queue has tasks, then the shared queue gets a turn, see find_task()
+		static constexpr unsigned int MAX_LOCAL_POPS = 16;
+
+		struct SharedQueue;
+
+		struct Worker
+		{
+			Worker(MultiTask* conveyor_ptr, const unsigned int worker_index) :
+				conveyor(conveyor_ptr), index(worker_index), random(worker_index + 1) {}
+
+			MultiTask* const conveyor;
+			const unsigned int index;
+
+			// local tasks, used in work stealing mode only
+			WorkStealingDeque deque;
+
+			// tasks taken from the shared queue in global queue mode, the next one is at the back,
+			// in ring mode tasks kept by a worker too deep in helping, in work stealing mode empty between pops
+			vector<unique_ptr<Task>> batch;
+
+			// shared queue the batch was taken from in global queue mode, see return_batch()
+			SharedQueue* batch_queue = nullptr;
+
+			// nested help_until() calls, see MAX_HELP_DEPTH
+			unsigned int help_depth = 0;
+
+			// deque pops since the last shared queue pop in work stealing mode, see MAX_LOCAL_POPS
+			unsigned int local_pops = 0;
+
+			// idle worker sleeps here, other threads write it to wake the worker
+			MULTI_TASK_CONVEYOR_CACHE_ALIGNED Parker parker;
+
+			// victim selection for stealing
+			MULTI_TASK_CONVEYOR_CACHE_ALIGNED minstd_rand random;
+
+			// priority rings selection in ring mode
+			LaneSelector lanes;
+
+			// NUMA node of the worker shared queue and the allowed cpus, empty - any cpu
+			unsigned int node = 0;
+			vector<unsigned int> cpus;
+
+			// the deque buffer was allocated by the pinned worker thread, see process_task()
+			bool deque_relocated = false;
+
+			// the thread is started, guarded by m_pool_mutex
+			bool running = false;
+
+			// the thread options failed, set by the worker thread, see apply_thread_options()
+			atomic_bool affinity_failed{ false };
+			atomic_bool scheduling_failed{ false };
+
+			// moving average of the time from running out of tasks to the next task, every sample clamped, see next_task()
+			chrono::nanoseconds idle_gap{ 0 };
+
+			// completed tasks of done_job not taken off its running count yet, see run_task()
+			Job* done_job = nullptr;
+			unsigned long done_count = 0;
+
+			// latency per job, only the worker and latency_snapshot() take the mutex,
+			// jobs dropped from the map are merged into retired_latency
+			mutex latency_mutex;
+			map<JOBID, JobLatency> latency;
+			TaskLatency retired_latency;
+
+			// stats counters, written by the worker thread only and summed by stats()
+			MULTI_TASK_CONVEYOR_CACHE_ALIGNED atomic_ullong tasks_pushed{ 0 };
+			atomic_ullong tasks_completed{ 0 };
+			atomic_size_t batch_size{ 0 };
+
+			// steady clock nanoseconds, idle_since_ns is 0 while busy, stopped_ns is 0 while running
+			atomic<long long> started_ns{ 0 };
+			atomic<long long> stopped_ns{ 0 };
+			atomic<long long> idle_since_ns{ 0 };
+			atomic<long long> idle_ns{ 0 };
+			atomic<long long> parked_ns{ 0 };
+
+			MULTI_TASK_CONVEYOR_CACHE_ALIGNED thread worker_thread;
+		};
+
+		// shared tasks queue, one per NUMA node
+		struct MULTI_TASK_CONVEYOR_CACHE_ALIGNED SharedQueue
+		{
+			// called under queue_mutex
+			void update_sizes()
+			{
+				size = tasks.size();
+				high_size = tasks.lane_size(TaskPriority::high);
+
+				if (tasks.size() > max_size.load(memory_order_relaxed))
+					max_size.store(tasks.size(), memory_order_relaxed);
+			}
+
+			mutex queue_mutex;
+			condition_variable_any task_done;
+
+			// producers blocked on max_tasks, guarded by queue_mutex
+			unsigned int waiting_producers = 0;
+
+			PriorityTaskQueue tasks;
+
+			// tasks queue sizes readable without the lock
+			atomic_size_t size{ 0 };
+			atomic_size_t high_size{ 0 };
+			atomic_size_t max_size{ 0 };
+		};
+
+		// "0-3,8-11" format of the sysfs lists
+		static vector<unsigned int> parse_list(const string& list)
+		{
+			vector<unsigned int> items;
+			for (size_t pos = 0; pos < list.size();)
+			{
+				size_t end = list.find(',', pos);
+				if (end == string::npos)
+					end = list.size();
+
+				const string range = list.substr(pos, end - pos);
+				const size_t dash = range.find('-');
+				const unsigned long first = stoul(range);
+				const unsigned long last = dash == string::npos ? first : stoul(range.substr(dash + 1));
+
+				for (unsigned long item = first; item <= last; ++item)
+					items.push_back(static_cast<unsigned int>(item));
+
+				pos = end + 1;
+			}
+
+			return items;
+		}
+
+		// cpus of every NUMA node with cpus from the sysfs node directory, empty if unknown
+		static vector<vector<unsigned int>> read_numa_nodes([[maybe_unused]] const string& path)
+		{
+			vector<vector<unsigned int>> nodes;
+
+#ifdef __linux__
+			ifstream online(path + "/online");
+			string list;
+			if (!online || !getline(online, list))
+				return nodes;
+
+			for (const unsigned int node : parse_list(list))
+			{
+				ifstream file(path + "/node" + to_string(node) + "/cpulist");
+				string cpus_list;
+				if (!file || !getline(file, cpus_list))
+					continue;
+
+				// memory only nodes have no cpus and get no queue
+				if (vector<unsigned int> cpus = parse_list(cpus_list); !cpus.empty())
+					nodes.push_back(move(cpus));
+			}
+#endif
+
+			return nodes;
+		}
+
+		// affinity, name and scheduling of the calling worker thread, affinity and scheduling failures are kept for stats()
+		void apply_thread_options([[maybe_unused]] Worker& worker)
+		{
+#ifdef __linux__
+			bool affinity_failed = false;
+			if (!worker.cpus.empty())
+			{
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				for (const unsigned int cpu : worker.cpus)
+					if (cpu < CPU_SETSIZE)
+						CPU_SET(cpu, &cpus);
+
+				affinity_failed = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0;
+			}
+
+			// the whole index stays in the name, the prefix is cut instead
+			if (!m_thread_name.empty())
+			{
+				const string index = to_string(worker.index);
+				pthread_setname_np(pthread_self(), (m_thread_name.substr(0, 15 - index.size()) + index).c_str());
+			}
+
+			bool scheduling_failed = false;
+			if (m_sched_policy >= 0)
+			{
+				sched_param param{};
+				param.sched_priority = m_sched_priority;
+				scheduling_failed = pthread_setschedparam(pthread_self(), m_sched_policy, &param) != 0;
+			}
+
+			// nice is per thread on linux
+			if (m_nice && setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), m_nice) != 0)
+				scheduling_failed = true;
+
+			worker.affinity_failed.store(affinity_failed, memory_order_relaxed);
+			worker.scheduling_failed.store(scheduling_failed, memory_order_relaxed);
+#endif
+		}
+
+		// a worker pushes to its node queue, other threads to the queue of the node they run on
+		SharedQueue& push_queue()
+		{
+			if (Worker* worker = current_worker())
+				return *m_queues[worker->node];
+
+#ifdef __linux__
+			if (m_queues.size() > 1)
+				if (const int cpu = sched_getcpu(); cpu >= 0 && static_cast<size_t>(cpu) < m_cpu_nodes.size())
+					return *m_queues[m_cpu_nodes[cpu]];
+#endif
+
+			return *m_queues[0];
+		}
+
+		static TaskPriority task_priority(Task* task)
+		{
+			return task->get_id() ? task->get_id()->get_priority() : TaskPriority::normal;
+		}
+
+		// tasks run on workers only: in their loop or while helping in help_until()
+		void run_task(Worker& worker, unique_ptr<Task> task)
+		{
+			const JOBID jobid = task->get_id();
+
+			// the task may wait for the job whose completions the worker holds
+			if (worker.done_job != jobid)
+				flush_completed(worker);
+
+			if (Trace::enabled || m_collect_latency)
+			{
+				// one timing feeds both the trace and the histograms
+				const auto started = chrono::steady_clock::now();
+				task->process();
+				const auto finished = chrono::steady_clock::now();
+
+				if constexpr (Trace::enabled)
+					Trace::complete("task", reinterpret_cast<unsigned long long>(jobid), started, finished);
+
+				if (m_collect_latency)
+				{
+					lock_guard lk(worker.latency_mutex);
+
+					TaskLatency& latency = job_latency(worker, jobid);
+					latency.queue_wait.record(chrono::duration_cast<chrono::nanoseconds>(started - task->m_pushed).count());
+					latency.run_time.record(chrono::duration_cast<chrono::nanoseconds>(finished - started).count());
+				}
+			}
+			else
+				task->process();
+
+			add_relaxed(worker.tasks_completed, 1);
+
+			// the job cannot complete before this task anyway, so a worker running tasks of the same job
+			// takes them off the running count at once, when it switches jobs, idles or blocks
+			if (jobid)
+			{
+				if (worker.done_job != jobid)
+					flush_completed(worker);
+
+				worker.done_job = jobid;
+				if (++worker.done_count >= MAX_HELD_COMPLETIONS)
+					flush_completed(worker);
+			}
+		}
+
+		// called under latency_mutex, the job is alive while its task runs
+		static TaskLatency& job_latency(Worker& worker, const JOBID jobid)
+		{
+			const unsigned long long serial = jobid ? jobid->m_serial : 0;
+
+			auto job = worker.latency.find(jobid);
+			if (job == worker.latency.end())
+			{
+				// the oldest job goes first, job-less tasks stay
+				if (worker.latency.size() >= MAX_LATENCY_JOBS)
+				{
+					auto oldest = min_element(worker.latency.begin(), worker.latency.end(), [](const auto& a, const auto& b) {
+						return (a.first ? a.second.serial : ULLONG_MAX) < (b.first ? b.second.serial : ULLONG_MAX);
+						});
+
+					worker.retired_latency.merge(oldest->second.latency);
+					worker.latency.erase(oldest);
+				}
+
+				job = worker.latency.try_emplace(jobid).first;
+				job->second.serial = serial;
+			}
+			else if (job->second.serial != serial)
+			{
+				// a dead job had the same address
+				worker.retired_latency.merge(job->second.latency);
+				job->second = JobLatency{ serial, {} };
+			}
+
+			return job->second.latency;
+		}
+
+		// takes the held completions off the job running count, may complete the job
+		static void flush_completed(Worker& worker)
+		{
+			Job* const job = worker.done_job;
+			const unsigned long count = worker.done_count;
+
+			// completing the job may run tasks on this worker
+			worker.done_job = nullptr;
+			worker.done_count = 0;
+
+			if (count)
+				job->dec_task_count(count);
+		}
+
+		// counts new tasks of the job, completions held by this worker are reused first:
+		// the running count already includes them
+		void count_job_tasks(const JOBID jobid, unsigned long count)
+		{
+			if (Worker* worker = current_worker(); worker && worker->done_job == jobid)
+			{
+				const unsigned long reused = min(count, worker->done_count);
+				worker->done_count -= reused;
+				count -= reused;
+			}
+
+			if (count)
+				jobid->inc_task_count(count);
+		}
+
+		static long long now_ns()
+		{
+			return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		// counter written by its owner thread only, no locked instruction needed
+		template<class T>
+		static void add_relaxed(atomic<T>& counter, const type_identity_t<T> value)
+		{
+			counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+		}
+
+		void count_pushed(const size_t count)
+		{
+			if (Worker* worker = current_worker())
+				add_relaxed(worker->tasks_pushed, static_cast<unsigned long long>(count));
+			else
+				m_external_pushed.fetch_add(count, memory_order_relaxed);
+		}
+
+		void count_stall(const long long stall_start)
+		{
+			m_stalls.fetch_add(1, memory_order_relaxed);
+			m_stall_ns.fetch_add(now_ns() - stall_start, memory_order_relaxed);
+		}
+
+		void push_ring(Task* task, const TaskPriority priority, const bool single_task = true)
+		{
+			const size_t lane = static_cast<size_t>(priority);
+			BoundedTaskRing& ring = *m_rings[lane];
+
+			// count the task before publishing because a worker may complete it immediately
+			if (single_task && task->get_id())
+				count_job_tasks(task->get_id(), 1);
+
+			if (!ring.push(task))
+			{
+				if (Worker* worker = current_worker())
+				{
+					// the helping tasks push too, so deep enough the worker keeps the task for itself
+					// instead of running out of stack
+					if (worker->help_depth >= MAX_HELP_DEPTH)
+					{
+						worker->batch.emplace_back(task);
+						return;
+					}
+
+					help_until(*worker, [&ring, task]() {return ring.push(task); });
+				}
+				else
+				{
+					const long long stall_start = now_ns();
+
+					++m_blocked_pushers;
+
+					// pushed tasks of the batch must be running while this producer waits
+					if (!single_task)
+						wake_workers(m_workers.size());
+
+					while (1)
+					{
+						const unsigned int pops = m_ring_pops.load();
+						atomic_thread_fence(memory_order_seq_cst);
+
+						if (ring.push(task))
+							break;
+
+						if (m_stop)
+						{
+							--m_blocked_pushers;
+							drop_task(unique_ptr<Task>(task));
+							return;
+						}
+
+						m_ring_pops.wait(pops);
+					}
+
+					--m_blocked_pushers;
+
+					count_stall(stall_start);
+				}
+			}
+
+			// high water mark, a lost race only makes it slightly lower
+			if (const size_t depth = ring.size(); depth > m_ring_max_depth[lane].load(memory_order_relaxed))
+				m_ring_max_depth[lane].store(depth, memory_order_relaxed);
+
+			if (single_task)
+				wake_worker();
+		}
+
+		void push_batch(vector<unique_ptr<Task>>& batch)
+		{
+			if (batch.empty())
+				return;
+
+			if (m_collect_latency)
+			{
+				const auto now = chrono::steady_clock::now();
+				for (auto& task : batch)
+					task->m_pushed = now;
+			}
+
+			if constexpr (Trace::enabled)
+				Trace::instant("push batch", batch.size());
+
+			count_pushed(batch.size());
+
+			// one counter update for every run of tasks of the same job, all before publishing
+			for (size_t first = 0, i = 1; i <= batch.size(); ++i)
+				if (i == batch.size() || batch[i]->get_id() != batch[first]->get_id())
+				{
+					if (JOBID jobid = batch[first]->get_id())
+						count_job_tasks(jobid, static_cast<unsigned long>(i - first));
+
+					first = i;
+				}
+
+			if (m_scheduler == SchedulerMode::lock_free_ring)
+			{
+				for (auto& task : batch)
+				{
+					const TaskPriority priority = task_priority(task.get());
+					push_ring(task.release(), priority, false);
+				}
+			}
+			else
+			{
+				size_t pushed = 0;
+
+				// normal tasks pushed from a worker go to its own deque, the rest to the shared queue lanes
+				if (Worker* worker = current_worker(); worker && m_scheduler == SchedulerMode::work_stealing)
+					for (auto& task : batch)
+						if (task_priority(task.get()) == TaskPriority::normal)
+						{
+							worker->deque.push(task.release());
+							++pushed;
+						}
+
+				if (pushed == batch.size())
+				{
+					wake_workers(pushed);
+					return;
+				}
+
+				SharedQueue& queue = push_queue();
+				unique_lock lk(queue.queue_mutex);
+
+				for (auto& task : batch)
+				{
+					if (!task)
+						continue;
+
+					if (m_max_tasks && queue.tasks.size() >= m_max_tasks)
+					{
+						// already pushed tasks must be running while this producer waits
+						wake_workers(pushed);
+						pushed = 0;
+
+						wait_for_room(queue, lk);
+					}
+
+					const TaskPriority priority = task_priority(task.get());
+					queue.tasks.push(move(task), priority);
+					queue.update_sizes();
+					++pushed;
+				}
+
+				lk.unlock();
+
+				wake_workers(pushed);
+				return;
+			}
+
+			wake_workers(batch.size());
+		}
+
+		// called under queue_mutex when the queue holds max_tasks, returns with the mutex locked
+		void wait_for_room(SharedQueue& queue, unique_lock<mutex>& lk)
+		{
+			const long long stall_start = now_ns();
+
+			if (Worker* worker = current_worker())
+			{
+				// deep in nested helping the worker pushes over max_tasks rather than running out of stack
+				if (worker->help_depth >= MAX_HELP_DEPTH)
+					return;
+
+				lk.unlock();
+
+				help_until(*worker, [this, &queue]() {return m_stop || queue.size.load(memory_order_relaxed) < m_max_tasks; });
+
+				lk.lock();
+			}
+			else
+			{
+				++queue.waiting_producers;
+				queue.task_done.wait(lk, [this, &queue]() {return m_stop || queue.tasks.size() < m_max_tasks; });
+				--queue.waiting_producers;
+			}
+
+			count_stall(stall_start);
+		}
+
+		// a worker must not block waiting for other tasks, all workers could end up waiting, so it runs queued tasks
+		// until done() is true, the tasks run here may push and help in turn, help_depth counts the nesting
+		template<class Done>
+		void help_until(Worker& worker, Done&& done)
+		{
+			++worker.help_depth;
+
+			// at terminate the tasks are dropped instead, the awaited jobs complete without them
+			while (!done())
+				if (auto task = find_task(worker))
+				{
+					if (m_stop)
+						drop_task(move(task));
+					else
+						run_task(worker, move(task));
+				}
+				else
+				{
+					flush_completed(worker);
+					this_thread::yield();
+				}
+
+			--worker.help_depth;
+
+			// the caller may wait for the jobs of the tasks run here
+			flush_completed(worker);
+		}
+
+		// a task not run at terminate still leaves its job, the job completes when all its tasks are run or dropped
+		static void drop_task(unique_ptr<Task> task)
+		{
+			const JOBID jobid = task->get_id();
+			task.reset();
+
+			if (jobid)
+				jobid->dec_task_count();
+		}
+
+		// called after the workers stopped, until nothing is left because completed jobs may push more tasks
+		void drop_left_tasks()
+		{
+			vector<unique_ptr<Task>> dropped;
+			do
+			{
+				for (auto& task : dropped)
+					drop_task(move(task));
+
+				dropped.clear();
+
+				for (auto& queue : m_queues)
+				{
+					lock_guard lk(queue->queue_mutex);
+
+					while (queue->tasks.size())
+						dropped.push_back(queue->tasks.pop());
+
+					queue->update_sizes();
+				}
+
+				for (auto& ring : m_rings)
+					if (ring)
+						while (Task* task = ring->pop())
+							dropped.emplace_back(task);
+
+				for (auto& w : m_workers)
+				{
+					for (auto& task : w->batch)
+						dropped.push_back(move(task));
+
+					w->batch.clear();
+
+					while (Task* task = w->deque.pop())
+						dropped.emplace_back(task);
+				}
+			} while (!dropped.empty());
+		}
+
+		// every worker serves the priority rings by its own weighted round robin
+		Task* pop_ring(Worker& worker)
+		{
+			Task* task = nullptr;
+			while (!task)
+			{
+				const size_t lane = worker.lanes.select([this](const size_t l) {return !m_rings[l]->empty(); });
+				if (lane == PRIORITY_LANES)
+					return nullptr;
+
+				task = m_rings[lane]->pop();
+			}
+
+			// pairs with the fence in push_ring()
+			atomic_thread_fence(memory_order_seq_cst);
+
+			if (m_blocked_pushers.load(memory_order_relaxed))
+			{
+				++m_ring_pops;
+				m_ring_pops.notify_all();
+			}
+
+			return task;
+		}
+
+		Worker* current_worker()
+		{
+			return (t_current_worker && t_current_worker->conveyor == this) ? t_current_worker : nullptr;
+		}
+
+		// blocks until a task is available, returns empty task on terminate
+		unique_ptr<Task> next_task(Worker& worker)
+		{
+			chrono::steady_clock::time_point idle_since;
+
+			while (1)
+			{
+				if (m_stop)
+					return {};
+
+				auto task = find_task(worker);
+
+				// nobody else completes the jobs whose completions this worker holds
+				if (!task)
+					flush_completed(worker);
+
+				// a short wait before parking, once per idle period
+				if (!task && idle_since == chrono::steady_clock::time_point())
+				{
+					idle_since = chrono::steady_clock::now();
+					worker.idle_since_ns.store(chrono::duration_cast<chrono::nanoseconds>(idle_since.time_since_epoch()).count(), memory_order_relaxed);
+
+					task = spin_for_task(worker);
+				}
+
+				if (task)
+				{
+					if (idle_since != chrono::steady_clock::time_point())
+					{
+						const chrono::nanoseconds idle = chrono::steady_clock::now() - idle_since;
+
+						// a parked period counts as twice the wait budget at most, so one quiet gap between bursts
+						// does not turn the wait off for the next ones, a run of long gaps still does
+						const chrono::nanoseconds budget = m_idle_spin + m_idle_yield;
+						worker.idle_gap = (worker.idle_gap * 7 + min(idle, 2 * budget)) / 8;
+
+						add_relaxed(worker.idle_ns, static_cast<long long>(idle.count()));
+						worker.idle_since_ns.store(0, memory_order_relaxed);
+					}
+
+					worker.batch_size.store(worker.batch.size(), memory_order_relaxed);
+					return task;
+				}
+
+				// the pushing thread checks idle workers after publishing the task, see wake_worker()
+				push_idle(worker);
+				atomic_thread_fence(memory_order_seq_cst);
+
+				if (m_stop || has_tasks())
+				{
+					// if somebody already took this worker from the stack, its unpark() only costs one extra loop
+					cancel_idle(worker);
+					continue;
+				}
+
+				// the slabs of a finished burst of tasks go back to the system instead of staying in the pool
+				TaskAllocator::trim();
+
+				const long long park_start = now_ns();
+
+				if (worker.index < m_min_workers)
+				{
+					worker.parker.park();
+					add_relaxed(worker.parked_ns, now_ns() - park_start);
+
+					if constexpr (Trace::enabled)
+						Trace::complete("park", worker.index, park_start);
+
+					continue;
+				}
+
+				// an extra worker of the elastic pool retires after the idle timeout,
+				// unless somebody took it from the stack to wake it meanwhile
+				const bool unparked = worker.parker.park_for(m_idle_timeout);
+				add_relaxed(worker.parked_ns, now_ns() - park_start);
+
+				if constexpr (Trace::enabled)
+					Trace::complete("park", worker.index, park_start);
+
+				if (unparked || !cancel_idle(worker))
+					continue;
+
+				lock_guard lk(m_pool_mutex);
+
+				worker.running = false;
+				--m_active_workers;
+
+				return {};
+			}
+		}
+
+		static void cpu_relax()
+		{
+#if defined(_MSC_VER)
+			_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#elif defined(__aarch64__)
+			__asm__ __volatile__("yield");
+#endif
+		}
+
+		// spins, then yields while a task is likely to come soon, empty task if none came
+		unique_ptr<Task> spin_for_task(Worker& worker)
+		{
+			chrono::nanoseconds wait = m_idle_spin + m_idle_yield;
+			if (m_adaptive_idle)
+				wait = worker.idle_gap > wait ? chrono::nanoseconds(0) : min(wait, 2 * worker.idle_gap);
+
+			if (wait.count() == 0)
+				return {};
+
+			const auto start = chrono::steady_clock::now();
+			const auto spin_end = start + min(wait, chrono::duration_cast<chrono::nanoseconds>(m_idle_spin));
+			const auto end = start + wait;
+
+			while (!m_stop)
+			{
+				if (has_tasks())
+					if (auto task = find_task(worker))
+						return task;
+
+				const auto now = chrono::steady_clock::now();
+				if (now >= end)
+					break;
+
+				if (now < spin_end)
+					cpu_relax();
+				else
+					this_thread::yield();
+			}
+
+			return {};
+		}
+
+		// starts an extra worker if nobody is idle and tasks are piling up in the shared queues
+		void grow_pool()
+		{
+			if (m_active_workers.load(memory_order_relaxed) >= m_workers.size() || m_stop)
+				return;
+
+			size_t waiting = 0;
+			for (auto& queue : m_queues)
+				waiting += queue->size.load(memory_order_relaxed);
+
+			for (auto& ring : m_rings)
+				if (ring)
+					waiting += ring->size();
+
+			if (waiting < m_grow_queue_depth)
+				return;
+
+			// one thread starts workers at a time, others go on with their tasks
+			unique_lock lk(m_pool_mutex, try_to_lock);
+			if (!lk.owns_lock() || m_stop)
+				return;
+
+			for (auto& w : m_workers)
+				if (!w->running)
+				{
+					// the retired thread is already out of its loop
+					if (w->worker_thread.joinable())
+						w->worker_thread.join();
+
+					w->running = true;
+					++m_active_workers;
+					w->worker_thread = thread(&MultiTask::process_task, this, w->index);
+					return;
+				}
+		}
+
+		// global queue mode: own batch, then the shared queue
+		// ring mode: the rings only
+		// work stealing mode: own deque, then shared queue, then other workers deques, the shared queue goes first
+		// after MAX_LOCAL_POPS deque tasks in a row
+		// high priority tasks in the node shared queue go ahead of the batch or the deque in both modes
+		// shared queues and deques of the worker node go before other nodes ones
+		unique_ptr<Task> find_task(Worker& worker)
+		{
+			if (m_scheduler == SchedulerMode::lock_free_ring)
+			{
+				if (!worker.batch.empty())
+				{
+					auto task = move(worker.batch.back());
+					worker.batch.pop_back();
+					return task;
+				}
+
+				return unique_ptr<Task>(pop_ring(worker));
+			}
+
+			const bool has_local = m_scheduler == SchedulerMode::work_stealing ? !worker.deque.empty() : !worker.batch.empty();
+
+			if (SharedQueue& queue = *m_queues[worker.node]; has_local && queue.high_size.load(memory_order_relaxed))
+				if (auto task = pop_high(queue))
+					return task;
+
+			if (m_scheduler == SchedulerMode::work_stealing)
+			{
+				// a worker feeding its own deque would keep the shared lanes waiting forever,
+				// so they get a turn every MAX_LOCAL_POPS local tasks and are served by their weights then
+				if (SharedQueue& queue = *m_queues[worker.node]; worker.local_pops >= MAX_LOCAL_POPS && queue.size.load(memory_order_relaxed))
+				{
+					worker.local_pops = 0;
+					if (auto task = pop_shared(worker, queue))
+						return task;
+				}
+
+				if (Task* task = worker.deque.pop())
+				{
+					++worker.local_pops;
+					return unique_ptr<Task>(task);
+				}
+
+				worker.local_pops = 0;
+			}
+			else if (!worker.batch.empty())
+			{
+				auto task = move(worker.batch.back());
+				worker.batch.pop_back();
+				return task;
+			}
+
+			for (size_t i = 0; i < m_queues.size(); ++i)
+				if (auto task = pop_shared(worker, *m_queues[(worker.node + i) % m_queues.size()]))
+					return task;
+
+			if (m_scheduler == SchedulerMode::global_queue)
+				return {};
+
+			const size_t workers_count = m_workers.size();
+			const size_t first_victim = worker.random() % workers_count;
+			for (const bool same_node : { true, false })
+				for (size_t i = 0; i < workers_count; ++i)
+				{
+					Worker& victim = *m_workers[(first_victim + i) % workers_count];
+					if (&victim == &worker || (victim.node == worker.node) != same_node)
+						continue;
+
+					if (Task* task = victim.deque.steal())
+					{
+						if constexpr (Trace::enabled)
+							Trace::instant("steal", victim.index);
+
+						return unique_ptr<Task>(task);
+					}
+				}
+
+			return {};
+		}
+
+		// takes a batch from the shared queue, returns its first task
+		unique_ptr<Task> pop_shared(Worker& worker, SharedQueue& queue)
+		{
+			if (queue.size.load(memory_order_relaxed) == 0)
+				return {};
+
+			unique_lock lk(queue.queue_mutex);
+
+			if (queue.tasks.size() == 0)
+				return {};
+
+			// a fair share of the queue, so a short queue is still spread over all workers
+			const size_t batch_size = min<size_t>(m_max_batch_size, max<size_t>(1, queue.tasks.size() / get_worker_count()));
+
+			auto task = queue.tasks.pop();
+
+			for (size_t i = 1; i < batch_size; ++i)
+				worker.batch.push_back(queue.tasks.pop());
+
+			queue.update_sizes();
+
+			// only producers blocked on max_tasks are interested in a free place
+			const bool notify_producer = queue.waiting_producers > 0;
+
+			lk.unlock();
+
+			// the next task is at the back, in work stealing mode the rest of the batch goes to the deque,
+			// where it is stealable and the owner pops it in the queue order too
+			if (m_scheduler == SchedulerMode::work_stealing)
+			{
+				for (auto it = worker.batch.rbegin(); it != worker.batch.rend(); ++it)
+					worker.deque.push(it->release());
+
+				worker.batch.clear();
+			}
+			else
+			{
+				reverse(worker.batch.begin(), worker.batch.end());
+				worker.batch_queue = &queue;
+			}
+
+			if (notify_producer)
+			{
+				if (batch_size > 1)
+					queue.task_done.notify_all();
+				else
+					queue.task_done.notify_one();
+			}
+
+			return task;
+		}
+
+		// a worker about to block hands its batch back, nobody else can run the tasks there
+		void return_batch(Worker& worker)
+		{
+			if (worker.batch.empty())
+				return;
+
+			const size_t count = worker.batch.size();
+
+			if (m_scheduler == SchedulerMode::lock_free_ring)
+			{
+				// the tasks were kept on a full ring, the ones still not fitting stay,
+				// the next task is at the back
+				vector<unique_ptr<Task>> kept;
+				for (auto task = worker.batch.rbegin(); task != worker.batch.rend(); ++task)
+					if (m_rings[static_cast<size_t>(task_priority(task->get()))]->push(task->get()))
+						task->release();
+					else
+						kept.push_back(move(*task));
+
+				reverse(kept.begin(), kept.end());
+				worker.batch = move(kept);
+			}
+			else
+			{
+				// back to the queue that counted the tasks popped, which may be another node one
+				SharedQueue& queue = *worker.batch_queue;
+				lock_guard lk(queue.queue_mutex);
+
+				// the next task is at the back, so it goes to the front last
+				for (auto& task : worker.batch)
+				{
+					const TaskPriority priority = task_priority(task.get());
+					queue.tasks.push_front(move(task), priority);
+				}
+
+				queue.update_sizes();
+				worker.batch.clear();
+			}
+
+			wake_workers(count - worker.batch.size());
+		}
+
+		// one high priority task, unless the high lane has spent its credits and a lower lane is due
+		unique_ptr<Task> pop_high(SharedQueue& queue)
+		{
+			unique_lock lk(queue.queue_mutex);
+
+			if (queue.tasks.next_lane() != static_cast<size_t>(TaskPriority::high))
+				return {};
+
+			auto task = queue.tasks.pop();
+			queue.update_sizes();
+
+			const bool notify_producer = queue.waiting_producers > 0;
+
+			lk.unlock();
+
+			if (notify_producer)
+				queue.task_done.notify_one();
+
+			return task;
+		}
+
+		bool has_tasks()
+		{
+			if (any_of(m_queues.begin(), m_queues.end(), [](const unique_ptr<SharedQueue>& queue) {return queue->size.load() > 0; }))
+				return true;
+
+			if (any_of(begin(m_rings), end(m_rings), [](const unique_ptr<BoundedTaskRing>& ring) {return ring && !ring->empty(); }))
+				return true;
+
+			return any_of(m_workers.begin(), m_workers.end(), [](const unique_ptr<Worker>& w) {return !w->deque.empty(); });
+		}
+
+		void push_idle(Worker& worker)
+		{
+			lock_guard lk(m_idle_mutex);
+
+			m_idle_workers.push_back(worker.index);
+			++m_idle_count;
+		}
+
+		// returns false if the worker was already taken from the stack
+		bool cancel_idle(Worker& worker)
+		{
+			lock_guard lk(m_idle_mutex);
+
+			if (auto it = find(m_idle_workers.begin(), m_idle_workers.end(), worker.index); it != m_idle_workers.end())
+			{
+				m_idle_workers.erase(it);
+				--m_idle_count;
+				return true;
+			}
+
+			return false;
+		}
+
+		// wakes at most one parked worker after a task was published, nothing to do if nobody sleeps
+		void wake_worker()
+		{
+			wake_workers(1);
+		}
+
+		// wakes min(count, parked workers) workers
+		void wake_workers(const size_t count)
+		{
+			atomic_thread_fence(memory_order_seq_cst);
+
+			if (count == 0)
+				return;
+
+			if (m_idle_count.load(memory_order_relaxed) == 0)
+			{
+				grow_pool();
+				return;
+			}
+
+			unsigned int indexes[64];
+			size_t woken = 0;
+
+			unique_lock lk(m_idle_mutex);
+
+			// the most recently parked workers have the warmest cache
+			while (woken < count && woken < size(indexes) && !m_idle_workers.empty())
+			{
+				indexes[woken++] = m_idle_workers.back();
+				m_idle_workers.pop_back();
+				--m_idle_count;
+			}
+
+			lk.unlock();
+
+			for (size_t i = 0; i < woken; ++i)
+			{
+				if constexpr (Trace::enabled)
+					Trace::instant("unpark", indexes[i]);
+
+				m_workers[indexes[i]]->parker.unpark();
+			}
+
+			// more than 64 parked workers, rare enough for another round
+			if (woken == size(indexes) && count > woken)
+				wake_workers(count - woken);
+		}
+
+		// read mostly, workers check these on every task
+
+		// max tasks quantity
+		unsigned int m_max_tasks;
+
+		// max tasks taken from the shared queue at once
+		unsigned int m_max_batch_size;
+
+		SchedulerMode m_scheduler;
+
+		atomic_bool m_stop;
+
+		// task executing threads, the elastic pool ones too
+		vector<unique_ptr<Worker>> m_workers;
+
+		// lock free ring mode queues, one per priority
+		unique_ptr<BoundedTaskRing> m_rings[PRIORITY_LANES];
+
+		// shared tasks queues, one per NUMA node
+		vector<unique_ptr<SharedQueue>> m_queues;
+
+		// NUMA node of every cpu
+		vector<unsigned int> m_cpu_nodes;
+
+		// elastic pool limits, workers below m_min_workers never retire
+		unsigned int m_min_workers = 0;
+		size_t m_grow_queue_depth = 16;
+		chrono::milliseconds m_idle_timeout{ 1000 };
+
+		// idle policy
+		chrono::microseconds m_idle_spin{ 0 };
+		chrono::microseconds m_idle_yield{ 0 };
+		bool m_adaptive_idle = true;
+
+		bool m_collect_latency = false;
+
+		// workers thread options
+		string m_thread_name;
+		int m_sched_policy = -1;
+		int m_sched_priority = 0;
+		int m_nice = 0;
+
+		inline static thread_local Worker* t_current_worker = nullptr;
+		inline static thread_local MultiTask* t_job_conveyor = nullptr;
+
+		// written while workers run, every group starts a cache line so the writes don't invalidate the fields above
+
+		// jobs map
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED map<JOBID, unique_ptr<Job>> m_jobs_map;
+
+		// syncronisation objects for jobs map
+		mutex m_job_map_mutex;
+
+		// threads running Job::process(), started on demand up to m_max_job_threads,
+		// retired ones are joined when their place is reused
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED vector<thread> m_job_threads;
+		vector<size_t> m_retired_job_threads;
+		unsigned int m_max_job_threads;
+
+		// started jobs waiting for a job thread
+		deque<Job*> m_jobs_queue;
+
+		// syncronisation objects for jobs queue
+		mutex m_jobs_queue_mutex;
+		condition_variable m_new_job_cv;
+		unsigned int m_idle_job_threads = 0;
+		unsigned int m_blocked_job_threads = 0;
+		bool m_jobs_stop = false;
+
+		// elastic pool
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED mutex m_pool_mutex;
+		atomic_uint m_active_workers{ 0 };
+
+		// parked workers stack
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED mutex m_idle_mutex;
+		vector<unsigned int> m_idle_workers;
+		atomic_uint m_idle_count{ 0 };
+
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED atomic_size_t m_ring_max_depth[PRIORITY_LANES];
+
+		// producers waiting for a free ring cell wait for this counter to change
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED atomic_uint m_ring_pops{ 0 };
+		atomic_uint m_blocked_pushers{ 0 };
+
+		// stats counter of non worker threads, tasks are completed by workers only
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED atomic_ullong m_external_pushed{ 0 };
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED atomic_ullong m_stalls{ 0 };
+		atomic<long long> m_stall_ns{ 0 };
+
+		// previous stats() call for the rates
+		MULTI_TASK_CONVEYOR_CACHE_ALIGNED mutex m_stats_mutex;
+		chrono::steady_clock::time_point m_stats_time;
+		unsigned long long m_stats_pushed = 0;
+		unsigned long long m_stats_completed = 0;
+	};
+
+	// job whose tasks form a dependency graph: override build_graph() to add tasks with their predecessors,
+	// a task is pushed to the conveyor when all its predecessors are done, nobody waits for them
+	class GraphJob : public Job
+	{
+	public:
+		class Node
+		{
+		private:
+			friend class GraphJob;
+
+			unique_ptr<Task> m_task;
+
+			// not done predecessors
+			atomic_ulong m_dependencies{ 0 };
+
+			vector<Node*> m_successors;
+		};
+
+		// override this function to add the graph tasks
+		virtual void build_graph() = 0;
+
+		// tasks without predecessors are pushed when the graph is built
+		void process() override final
+		{
+			m_nodes.clear();
+
+			build_graph();
+
+			vector<unique_ptr<Task>> ready;
+			for (Node& node : m_nodes)
+				if (node.m_dependencies == 0)
+					ready.push_back(make_unique<NodeTask>(*this, node));
+
+			get_conveyor()->push_tasks(ready);
+		}
+
+		// predecessors must be nodes of this graph, added before
+		Node* add_task(unique_ptr<Task>&& task, const vector<Node*>& predecessors = {})
+		{
+			Node& node = m_nodes.emplace_back();
+			node.m_task = move(task);
+			node.m_dependencies = predecessors.size();
+
+			for (Node* predecessor : predecessors)
+				predecessor->m_successors.push_back(&node);
+
+			return &node;
+		}
+
+		template<derived_from<Task> T, class... Args>
+		Node* emplace_task(const vector<Node*>& predecessors, Args&& ...args)
+		{
+			return add_task(make_unique<T>(forward<Args>(args)...), predecessors);
+		}
+
+	private:
+		// runs the node task and pushes the successors it made ready
+		class NodeTask final : public Task
+		{
+		public:
+			NodeTask(GraphJob& job, Node& node) : Task(job.get_id()), m_job(job), m_node(node) {}
+
+			void process() override
+			{
+				m_node.m_task->process();
+				m_node.m_task.reset();
+
+				vector<unique_ptr<Task>> ready;
+				for (Node* successor : m_node.m_successors)
+					if (--successor->m_dependencies == 0)
+						ready.push_back(make_unique<NodeTask>(m_job, *successor));
+
+				// pushed before this task is done, so the job can not complete in between
+				if (!ready.empty())
+					m_job.get_conveyor()->push_tasks(ready);
+			}
+
+		private:
+			GraphJob& m_job;
+			Node& m_node;
+		};
+
+		// deque keeps the nodes addresses
+		deque<Node> m_nodes;
+	};
+
+	// job streaming items from a source through stages: every item passes the stages in order, different items
+	// are in different stages at once, a serial stage processes one item at a time in the source order,
+	// at most max_tokens items are in flight, so a stage buffer never holds more than max_tokens items
+	template<class Item>
+	class Pipeline : public Job
+	{
+	public:
+		// max_tokens - max items in flight, 0 - twice hardware concurrency
+		Pipeline(const size_t max_tokens = 0) : m_max_tokens(max_tokens ? max_tokens : 2 * max(thread::hardware_concurrency(), 1u)) {}
+
+		// source is called by one thread at a time until it returns an empty optional
+		Pipeline& set_source(function<optional<Item>()> source)
+		{
+			m_source = move(source);
+			return *this;
+		}
+
+		Pipeline& add_stage(function<void(Item&)> body, const bool serial = false)
+		{
+			Stage& stage = m_stages.emplace_back();
+			stage.body = move(body);
+			stage.serial = serial;
+			return *this;
+		}
+
+		void process() override final
+		{
+			m_tokens = static_cast<long>(m_max_tokens);
+			m_source_paused = false;
+			m_next_seq = 0;
+
+			for (Stage& stage : m_stages)
+			{
+				stage.next_seq = 0;
+				stage.buffer.clear();
+			}
+
+			get_conveyor()->push_task(make_unique<SourceTask>(*this));
+		}
+
+		void process_after_done() override {}
+
+	private:
+		struct ItemState
+		{
+			Item value;
+			size_t seq;
+			size_t stage = 0;
+		};
+
+		struct Stage
+		{
+			function<void(Item&)> body;
+			bool serial = false;
+
+			// serial stage only, items coming out of order wait in the buffer
+			mutex buffer_mutex;
+			size_t next_seq = 0;
+			map<size_t, unique_ptr<ItemState>> buffer;
+		};
+
+		class SourceTask final : public Task
+		{
+		public:
+			SourceTask(Pipeline& pipeline) : Task(pipeline.get_id()), m_pipeline(pipeline) {}
+			void process() override { m_pipeline.run_source(); }
+
+		private:
+			Pipeline& m_pipeline;
+		};
+
+		class ItemTask final : public Task
+		{
+		public:
+			ItemTask(Pipeline& pipeline, unique_ptr<ItemState>&& item) : Task(pipeline.get_id()), m_pipeline(pipeline), m_item(move(item)) {}
+			void process() override { m_pipeline.run_item(move(m_item)); }
+
+		private:
+			Pipeline& m_pipeline;
+			unique_ptr<ItemState> m_item;
+		};
+
+		// reads items while there are free tokens, pauses until an item returns its token otherwise
+		void run_source()
+		{
+			while (1)
+			{
+				if (--m_tokens < 0)
+				{
+					++m_tokens;
+
+					// recheck after pausing, a token returned in between would not resume the source
+					m_source_paused = true;
+					if (m_tokens.load() <= 0 || !m_source_paused.exchange(false))
+						return;
+
+					continue;
+				}
+
+				optional<Item> value = m_source ? m_source() : nullopt;
+				if (!value)
+				{
+					// the source is done, the job is done when the items in flight are done
+					++m_tokens;
+					return;
+				}
+
+				auto item = make_unique<ItemState>(ItemState{ move(*value), m_next_seq++ });
+				get_conveyor()->push_task(make_unique<ItemTask>(*this, move(item)));
+			}
+		}
+
+		// runs the item stages inline until a busy serial stage takes the item into its buffer
+		void run_item(unique_ptr<ItemState> item)
+		{
+			while (item->stage < m_stages.size())
+			{
+				Stage& stage = m_stages[item->stage];
+
+				if (!stage.serial)
+				{
+					stage.body(item->value);
+					++item->stage;
+					continue;
+				}
+
+				{
+					lock_guard lk(stage.buffer_mutex);
+					if (item->seq != stage.next_seq)
+					{
+						stage.buffer.emplace(item->seq, move(item));
+						return;
+					}
+				}
+
+				stage.body(item->value);
+				++item->stage;
+
+				// the next item in order may be waiting, this thread takes it over and the current item goes on in a new task
+				unique_lock lk(stage.buffer_mutex);
+				auto next = stage.buffer.find(++stage.next_seq);
+				if (next == stage.buffer.end())
+					continue;
+
+				unique_ptr<ItemState> next_item = move(next->second);
+				stage.buffer.erase(next);
+				lk.unlock();
+
+				get_conveyor()->push_task(make_unique<ItemTask>(*this, move(item)));
+				item = move(next_item);
+			}
+
+			item.reset();
+			release_token();
+		}
+
+		void release_token()
+		{
+			++m_tokens;
+
+			if (m_source_paused.exchange(false))
+				get_conveyor()->push_task(make_unique<SourceTask>(*this));
+		}
+
+		const size_t m_max_tokens;
+		function<optional<Item>()> m_source;
 
-		// task executing threads
-		vector<thread> m_tasks;
+		// deque keeps the stages addresses, stage mutexes can not move
+		deque<Stage> m_stages;
 
-		// syncronisation objects for tasks queue
-		mutex m_task_queue_mutex;
-		condition_variable_any m_new_task_cv;
-		condition_variable_any m_task_done;
+		atomic_long m_tokens{ 0 };
+		atomic_bool m_source_paused{ false };
 
-		// tasks queue
-		deque<unique_ptr<Task>> m_tasks_queue;
+		// called by the source thread only
+		size_t m_next_seq = 0;
 	};
 }
@@ -0,0 +1,284 @@
+// benchmark.cpp : scheduler overhead benchmarks, results go to stdout as CSV lines:
+// benchmark,scheduler,workers,metric,value
+// run "benchmark quick" for a short run, build it with MULTI_TASK_CONVEYOR_PACKED_LAYOUT defined too
+// to compare the cache line layout of the header with the packed one
+//
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "MultiThreadTask.h"
+
+using namespace multi_task_conveyor;
+
+using bench_clock = std::chrono::steady_clock;
+
+static size_t g_tasks = 200000;
+
+static const char* scheduler_name(const SchedulerMode mode)
+{
+    switch (mode)
+    {
+    case SchedulerMode::global_queue: return "global_queue";
+    case SchedulerMode::work_stealing: return "work_stealing";
+    case SchedulerMode::lock_free_ring: return "lock_free_ring";
+    }
+    return "unknown";
+}
+
+static void report(const char* benchmark, const SchedulerMode mode, const unsigned int workers, const char* metric, const double value)
+{
+    std::cout << benchmark << "," << scheduler_name(mode) << "," << workers << "," << metric << "," << value << std::endl;
+}
+
+static double seconds_since(const bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// p50, p90, p99 and max of the samples in nanoseconds
+static void report_percentiles(const char* benchmark, const SchedulerMode mode, const unsigned int workers, std::vector<long long>& samples)
+{
+    if (samples.empty())
+        return;
+
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples](const double q) { return static_cast<double>(samples[static_cast<size_t>(q * (samples.size() - 1))]); };
+
+    report(benchmark, mode, workers, "p50_ns", at(0.5));
+    report(benchmark, mode, workers, "p90_ns", at(0.9));
+    report(benchmark, mode, workers, "p99_ns", at(0.99));
+    report(benchmark, mode, workers, "max_ns", static_cast<double>(samples.back()));
+}
+
+static MultiTask* make_conveyor(const SchedulerMode mode, const unsigned int workers, const unsigned int max_tasks = 0)
+{
+    MultiTaskOptions options;
+    options.task_threads = workers;
+    options.max_tasks = max_tasks;
+    options.scheduler = mode;
+    return new MultiTask(options);
+}
+
+class EmptyTask : public Task
+{
+public:
+    EmptyTask(const JOBID jobid) : Task(jobid) {}
+
+    void process() override {}
+};
+
+// pushes empty tasks one by one
+class EmptyJob : public Job
+{
+public:
+    EmptyJob(const size_t tasks) : m_tasks(tasks) {}
+
+    void process() override {
+        for (size_t i = 0; i < m_tasks; ++i)
+            get_conveyor()->emplace_task<EmptyTask>(get_id());
+    }
+
+    void process_after_done() override {}
+
+    size_t m_tasks;
+};
+
+// records when process() starts
+class StartJob : public Job
+{
+public:
+    void process() override {
+        m_started = bench_clock::now();
+    }
+
+    void process_after_done() override {}
+
+    bench_clock::time_point m_started;
+};
+
+// empty tasks throughput, 1..hardware threads workers
+static void bench_throughput(const SchedulerMode mode, const unsigned int workers)
+{
+    MultiTask* mt = make_conveyor(mode, workers);
+
+    const auto start = bench_clock::now();
+    EmptyJob* job = mt->emplace_job<EmptyJob>(g_tasks);
+    mt->wait_job_done(job);
+
+    report("empty_tasks", mode, workers, "tasks_per_sec", g_tasks / seconds_since(start));
+
+    delete mt;
+}
+
+// time from push_task to the task start, tasks are pushed one at a time with a pause between them
+static void bench_latency(const SchedulerMode mode, const unsigned int workers)
+{
+    MultiTask* mt = make_conveyor(mode, workers);
+
+    const size_t count = std::max<size_t>(g_tasks / 100, 100);
+    std::vector<long long> samples(count);
+    std::atomic_size_t done{ 0 };
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const auto pushed = bench_clock::now();
+        mt->submit(nullptr, [&samples, &done, pushed, i]() {
+            samples[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - pushed).count();
+            ++done;
+            });
+
+        // gaps between tasks make workers go idle sometimes
+        const auto until = bench_clock::now() + std::chrono::microseconds(i % 4 == 0 ? 200 : 10);
+        while (bench_clock::now() < until)
+            std::this_thread::yield();
+    }
+
+    while (done < count)
+        std::this_thread::yield();
+
+    report_percentiles("push_latency", mode, workers, samples);
+
+    delete mt;
+}
+
+// several producer threads pushing job-less tasks at once
+static void bench_producers(const SchedulerMode mode, const unsigned int workers, const unsigned int producers)
+{
+    MultiTask* mt = make_conveyor(mode, workers);
+
+    const size_t per_producer = g_tasks / producers;
+    std::atomic_size_t done{ 0 };
+
+    const auto start = bench_clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned int p = 0; p < producers; ++p)
+        threads.emplace_back([mt, per_producer, &done]() {
+            for (size_t i = 0; i < per_producer; ++i)
+                mt->submit(nullptr, [&done]() { ++done; });
+            });
+
+    for (auto& t : threads)
+        t.join();
+
+    while (done < per_producer * producers)
+        std::this_thread::yield();
+
+    const std::string name = "producers_" + std::to_string(producers);
+    report(name.c_str(), mode, workers, "tasks_per_sec", per_producer * producers / seconds_since(start));
+
+    delete mt;
+}
+
+// one producer blocked by a short shared queue
+static void bench_backpressure(const SchedulerMode mode, const unsigned int workers)
+{
+    MultiTask* mt = make_conveyor(mode, workers, 64);
+
+    const auto start = bench_clock::now();
+    EmptyJob* job = mt->emplace_job<EmptyJob>(g_tasks);
+    mt->wait_job_done(job);
+
+    report("max_tasks_64", mode, workers, "tasks_per_sec", g_tasks / seconds_since(start));
+
+    delete mt;
+}
+
+// time from emplace_job to the job process() start
+static void bench_job_start(const SchedulerMode mode, const unsigned int workers)
+{
+    MultiTask* mt = make_conveyor(mode, workers);
+
+    const size_t count = std::max<size_t>(g_tasks / 200, 50);
+    std::vector<long long> samples;
+    samples.reserve(count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const auto start = bench_clock::now();
+        StartJob* job = mt->emplace_job<StartJob>();
+        mt->wait_job_done(job);
+
+        samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(job->m_started - start).count());
+        mt->pop_job(job);
+    }
+
+    report_percentiles("job_start", mode, workers, samples);
+
+    delete mt;
+}
+
+// one job per worker running at once, every task push and completion writes its job counter,
+// the metric is named after the header layout, compare a build with MULTI_TASK_CONVEYOR_PACKED_LAYOUT defined
+static void bench_concurrent_jobs(const SchedulerMode mode, const unsigned int workers)
+{
+    MultiTask* mt = make_conveyor(mode, workers);
+
+    const size_t per_job = g_tasks / workers;
+
+    const auto start = bench_clock::now();
+
+    std::vector<EmptyJob*> jobs;
+    for (unsigned int j = 0; j < workers; ++j)
+        jobs.push_back(mt->emplace_job<EmptyJob>(per_job));
+
+    for (EmptyJob* job : jobs)
+        mt->wait_job_done(job);
+
+    report("concurrent_jobs", mode, workers, PACKED_LAYOUT ? "packed_tasks_per_sec" : "padded_tasks_per_sec", per_job * workers / seconds_since(start));
+
+    delete mt;
+}
+
+// the same job restarted, 1000 tasks every pass
+static void bench_restart(const SchedulerMode mode, const unsigned int workers)
+{
+    MultiTask* mt = make_conveyor(mode, workers);
+
+    const size_t passes = std::max<size_t>(g_tasks / 1000, 10);
+    EmptyJob* job = mt->emplace_job<EmptyJob>(1000);
+    mt->wait_job_done(job);
+
+    const auto start = bench_clock::now();
+    for (size_t i = 0; i < passes; ++i)
+    {
+        mt->restart_job(job);
+        mt->wait_job_done(job);
+    }
+
+    report("restart_job", mode, workers, "passes_per_sec", passes / seconds_since(start));
+
+    delete mt;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string(argv[1]) == "quick")
+        g_tasks = 20000;
+
+    const unsigned int max_workers = std::max(std::thread::hardware_concurrency(), 1u);
+
+    std::cout << "benchmark,scheduler,workers,metric,value" << std::endl;
+
+    for (const SchedulerMode mode : { SchedulerMode::global_queue, SchedulerMode::work_stealing, SchedulerMode::lock_free_ring })
+    {
+        // scaling over the worker count, powers of two and max_workers
+        for (unsigned int workers = 1; workers < max_workers; workers *= 2)
+            bench_throughput(mode, workers);
+
+        bench_throughput(mode, max_workers);
+
+        bench_latency(mode, max_workers);
+        bench_producers(mode, max_workers, 1);
+        bench_producers(mode, max_workers, 4);
+        bench_backpressure(mode, max_workers);
+        bench_job_start(mode, max_workers);
+        bench_concurrent_jobs(mode, max_workers);
+        bench_restart(mode, max_workers);
+    }
+
+    return 0;
+}
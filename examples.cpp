@@ -0,0 +1,753 @@
+// examples.cpp : short examples of the MultiTask features, every example checks its result,
+// the program runs them with every scheduler, with and without NUMA placement on a made up two node topology,
+// and returns non zero if any of them failed
+//
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "MultiThreadTask.h"
+
+using namespace multi_task_conveyor;
+
+static int g_failed = 0;
+
+static void check(const char* example, const bool ok)
+{
+    std::cout << example << ": " << (ok ? "ok" : "FAILED") << std::endl;
+    if (!ok)
+        ++g_failed;
+}
+
+// parallel_for and parallel_reduce over an index range
+static void example_parallel(MultiTask& mt)
+{
+    std::vector<long long> squares(10000);
+    mt.parallel_for(0, 10000, 0, [&squares](const int i) { squares[i] = static_cast<long long>(i) * i; });
+
+    const long long sum = mt.parallel_reduce(0, 10000, 0ll,
+        [&squares](const int i) { return squares[i]; },
+        [](const long long a, const long long b) { return a + b; });
+
+    // sum of i^2 for i < n is (n - 1) n (2n - 1) / 6
+    check("parallel_for / parallel_reduce", sum == 9999ll * 10000 * 19999 / 6);
+}
+
+// parallel_for inside parallel_for, workers waiting for the inner ranges help with the outer one
+// only up to a depth, then the inner ranges run in the calling task
+static void example_nested_parallel(MultiTask& mt)
+{
+    std::vector<std::atomic_char> hits(50000 * 2);
+    mt.parallel_for(0, 50000, 1, [&mt, &hits](const int i) {
+        mt.parallel_for(0, 2, 1, [&hits, i](const int j) { ++hits[i * 2 + j]; });
+        });
+
+    check("nested parallel_for", std::all_of(hits.begin(), hits.end(), [](const std::atomic_char& hit) { return hit == 1; }));
+}
+
+// submit() pushes lambdas as tasks of a job
+class SumJob : public Job
+{
+public:
+    void process() override {
+        for (int i = 1; i <= 100; ++i)
+            get_conveyor()->submit(get_id(), [this, i]() { m_sum += i; });
+    }
+
+    void process_after_done() override {
+        m_result = m_sum;
+    }
+
+    std::atomic_int m_sum{ 0 };
+    int m_result = 0;
+};
+
+// a job waiting for jobs it started, the job threads blocked here don't hold the inner jobs back
+class OuterJob : public Job
+{
+public:
+    void process() override {
+        std::vector<SumJob*> inner;
+        for (int i = 0; i < 8; ++i)
+            inner.push_back(get_conveyor()->emplace_job<SumJob>());
+
+        for (SumJob* job : inner)
+        {
+            get_conveyor()->wait_job_done(job);
+            m_result += job->m_result;
+            get_conveyor()->pop_job(job);
+        }
+    }
+
+    void process_after_done() override {}
+
+    int m_result = 0;
+};
+
+// a job marking its tasks pushed itself, the second call after process() does not count again
+class SelfPushedJob : public Job
+{
+public:
+    void process() override {
+        for (int i = 0; i < 2; ++i)
+            get_conveyor()->submit(get_id(), [this]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                ++m_done;
+                });
+
+        set_all_tasks_pushed();
+    }
+
+    void process_after_done() override {
+        m_result = m_done;
+    }
+
+    std::atomic_int m_done{ 0 };
+    int m_result = 0;
+};
+
+static void example_jobs(MultiTask& mt)
+{
+    std::vector<OuterJob*> outer;
+    for (int i = 0; i < 4; ++i)
+        outer.push_back(mt.emplace_job<OuterJob>());
+
+    bool ok = true;
+    for (OuterJob* job : outer)
+    {
+        mt.wait_job_done(job);
+        ok = ok && job->m_result == 8 * 5050;
+        mt.pop_job(job);
+    }
+
+    SelfPushedJob* pushed = mt.emplace_job<SelfPushedJob>();
+    mt.wait_job_done(pushed);
+    ok = ok && pushed->m_result == 2;
+    mt.pop_job(pushed);
+
+    check("nested jobs", ok);
+}
+
+// a coroutine hops onto a worker, fans out, pushes tasks of its own job and awaits another job
+class ResultJob : public Job
+{
+public:
+    void process() override {}
+
+    void process_after_done() override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        m_result = 42;
+    }
+
+    int m_result = 0;
+};
+
+static CoroutineJob coroutine_body(MultiTask& mt, ResultJob* other, std::atomic_int& counter, int& result)
+{
+    co_await mt.schedule();
+
+    co_await mt.when_all([&counter]() { ++counter; }, [&counter]() { ++counter; });
+
+    // tasks of the coroutine job, it is done when they are done too
+    const JOBID id = co_await CoroutineJob::current_id();
+    for (int i = 0; i < 10; ++i)
+        mt.submit(id, [&counter]() { ++counter; });
+
+    // resumes after process_after_done() of the other job
+    co_await *other;
+    result = other->m_result;
+}
+
+static void example_coroutine(MultiTask& mt)
+{
+    std::atomic_int counter{ 0 };
+    int result = 0;
+
+    ResultJob* other = mt.emplace_job<ResultJob>();
+    {
+        CoroutineJob job = coroutine_body(mt, other, counter, result);
+        job.wait_until_done();
+    }
+
+    check("coroutine", counter == 12 && result == 42);
+
+    mt.pop_job(other);
+}
+
+// holds the only worker of a conveyor until opened, so the tasks pushed meanwhile queue up
+class Gate
+{
+public:
+    explicit Gate(MultiTask& mt) {
+        mt.submit(nullptr, [this]() {
+            m_started = true;
+            while (!m_open)
+                std::this_thread::yield();
+            });
+
+        while (!m_started)
+            std::this_thread::yield();
+    }
+
+    void open() { m_open = true; }
+
+private:
+    std::atomic_bool m_started{ false };
+    std::atomic_bool m_open{ false };
+};
+
+// with one worker, high priority tasks queued with normal and low ones run first,
+// the lanes are served by weights, so low priority tasks still run before the high lane drains
+static void example_priorities(const SchedulerMode mode)
+{
+    MultiTaskOptions options;
+    options.task_threads = 1;
+    options.scheduler = mode;
+
+    MultiTask mt(options);
+
+    std::vector<TaskPriority> order;
+    std::atomic_int done{ 0 };
+
+    Gate gate(mt);
+
+    for (const TaskPriority priority : { TaskPriority::low, TaskPriority::normal, TaskPriority::high })
+        for (int i = 0; i < 16; ++i)
+            mt.emplace_task<FunctionTask<std::function<void()>>>(priority, nullptr, std::function<void()>([&order, &done, priority]() {
+                order.push_back(priority);
+                ++done;
+                }));
+
+    gate.open();
+
+    while (done < 48)
+        std::this_thread::yield();
+
+    const auto first_low = std::find(order.begin(), order.end(), TaskPriority::low) - order.begin();
+    const LaneMetrics metrics = mt.lane_metrics(TaskPriority::high);
+
+    check("priorities", std::count(order.begin(), order.begin() + 8, TaskPriority::high) == 8 && first_low < 16
+        && metrics.pushed == 16 && metrics.popped == 16);
+}
+
+// pushes itself again until stopped, so its worker never runs out of tasks
+class ChainTask : public Task
+{
+public:
+    ChainTask(MultiTask& mt, std::atomic_int& runs, std::atomic_bool& stop, std::atomic_bool& stopped)
+        : Task(nullptr), m_mt(mt), m_runs(runs), m_stop(stop), m_stopped(stopped) {}
+
+    void process() override {
+        ++m_runs;
+        if (m_stop)
+            m_stopped = true;
+        else
+            m_mt.emplace_task<ChainTask>(m_mt, m_runs, m_stop, m_stopped);
+    }
+
+private:
+    MultiTask& m_mt;
+    std::atomic_int& m_runs;
+    std::atomic_bool& m_stop;
+    std::atomic_bool& m_stopped;
+};
+
+// a low priority task queued while the only worker feeds itself a chain of tasks still runs soon
+static void example_self_feeding(const SchedulerMode mode)
+{
+    MultiTaskOptions options;
+    options.task_threads = 1;
+    options.scheduler = mode;
+
+    MultiTask mt(options);
+
+    std::atomic_int runs{ 0 };
+    std::atomic_bool stop{ false };
+    std::atomic_bool stopped{ false };
+    std::atomic_bool low_done{ false };
+
+    mt.emplace_task<ChainTask>(mt, runs, stop, stopped);
+    while (runs < 100)
+        std::this_thread::yield();
+
+    mt.emplace_task<FunctionTask<std::function<void()>>>(TaskPriority::low, nullptr, std::function<void()>([&low_done]() { low_done = true; }));
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+    while (!low_done && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+
+    const bool ok = low_done;
+
+    stop = true;
+    while (!stopped)
+        std::this_thread::yield();
+
+    check("self feeding worker", ok);
+}
+
+// two jobs queue tasks in the same lane, the job with weight 4 gets four tasks per turn, the other one task
+class TaggedJob : public Job
+{
+public:
+    TaggedJob(std::vector<char>& order, std::atomic_int& pushed, const char tag) : m_order(order), m_pushed(pushed), m_tag(tag) {}
+
+    void process() override {
+        for (int i = 0; i < 20; ++i)
+            get_conveyor()->submit(get_id(), [this]() { m_order.push_back(m_tag); });
+
+        ++m_pushed;
+    }
+
+    void process_after_done() override {}
+
+private:
+    std::vector<char>& m_order;
+    std::atomic_int& m_pushed;
+    const char m_tag;
+};
+
+// jobs share a lane fairly in the shared queue modes, the lock free rings are plain FIFOs
+static void example_fair_share(const SchedulerMode mode)
+{
+    MultiTaskOptions options;
+    options.task_threads = 1;
+    options.scheduler = mode;
+
+    MultiTask mt(options);
+
+    std::vector<char> order;
+    std::atomic_int pushed{ 0 };
+
+    Gate gate(mt);
+
+    TaggedJob* a = mt.emplace_job<TaggedJob>(order, pushed, 'a');
+    auto heavy = std::make_unique<TaggedJob>(order, pushed, 'b');
+    heavy->set_weight(4);
+    TaggedJob* b = mt.push_job(std::move(heavy));
+
+    while (pushed < 2)
+        std::this_thread::yield();
+
+    gate.open();
+
+    mt.wait_job_done(a);
+    mt.wait_job_done(b);
+
+    // a b b b b a b b or b b b b a b b b
+    check("fair share", order.size() == 40 && std::count(order.begin(), order.begin() + 8, 'b') >= 6);
+
+    mt.pop_job(a);
+    mt.pop_job(b);
+}
+
+// the workers fan the job out three levels deep, 8 tasks per task, 585 tasks in total
+class FanOutJob : public Job
+{
+public:
+    explicit FanOutJob(std::atomic_int& tasks) : m_tasks(tasks) {}
+
+    void process() override {
+        get_conveyor()->submit(get_id(), [this]() { fan_out(0); });
+    }
+
+    void process_after_done() override {}
+
+private:
+    void fan_out(const int level) {
+        ++m_tasks;
+        if (level < 3)
+            for (int i = 0; i < 8; ++i)
+                get_conveyor()->submit(get_id(), [this, level]() { fan_out(level + 1); });
+    }
+
+    std::atomic_int& m_tasks;
+};
+
+// workers pushing to a full queue or ring run other tasks meanwhile, those push too, and the nesting stays bounded
+static void example_fan_out(MultiTask& mt)
+{
+    std::atomic_int tasks{ 0 };
+
+    std::vector<FanOutJob*> jobs;
+    for (int i = 0; i < 1000; ++i)
+        jobs.push_back(mt.emplace_job<FanOutJob>(tasks));
+
+    for (FanOutJob* job : jobs)
+    {
+        mt.wait_job_done(job);
+        mt.pop_job(job);
+    }
+
+    check("fan out jobs", tasks == 1000 * 585);
+}
+
+// the elastic pool starts extra workers under a backlog and retires them after idle_timeout_ms without tasks
+static void example_elastic_pool(const SchedulerMode mode)
+{
+    MultiTaskOptions options;
+    options.task_threads = 1;
+    options.max_task_threads = 3;
+    options.grow_queue_depth = 4;
+    options.idle_timeout_ms = 100;
+    options.scheduler = mode;
+
+    MultiTask mt(options);
+
+    std::atomic_int done{ 0 };
+    for (int i = 0; i < 64; ++i)
+        mt.submit(nullptr, [&done]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            ++done;
+            });
+
+    unsigned int grown = 0;
+    while (done < 64)
+    {
+        grown = std::max(grown, mt.get_worker_count());
+        std::this_thread::yield();
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+    while (mt.get_worker_count() > 1 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    check("elastic pool", grown > 1 && grown <= 3 && mt.get_worker_count() == 1);
+}
+
+// a root task making 64 successors ready at once
+class WideGraphJob : public GraphJob
+{
+public:
+    void build_graph() override {
+        Node* root = emplace_task<FunctionTask<std::function<void()>>>({}, get_id(), std::function<void()>([]() {}));
+        for (int i = 0; i < 64; ++i)
+            emplace_task<FunctionTask<std::function<void()>>>({ root }, get_id(), std::function<void()>([this]() { ++m_done; }));
+    }
+
+    void process_after_done() override {}
+
+    std::atomic_int m_done{ 0 };
+};
+
+// workers pushing over a tiny max_tasks run queued tasks instead of waiting for a place nobody frees
+static void example_max_tasks(const SchedulerMode mode)
+{
+    MultiTaskOptions options;
+    options.task_threads = 2;
+    options.max_tasks = 4;
+    options.scheduler = mode;
+
+    bool ok = true;
+    {
+        MultiTask mt(options);
+
+        std::vector<std::atomic_char> hits(1 << 16);
+        mt.parallel_for(0, 1 << 16, 1, [&hits](const int i) { ++hits[i]; });
+
+        ok = std::all_of(hits.begin(), hits.end(), [](const std::atomic_char& hit) { return hit == 1; });
+    }
+
+    options.task_threads = 1;
+    options.max_tasks = 8;
+    {
+        MultiTask mt(options);
+
+        WideGraphJob* job = mt.emplace_job<WideGraphJob>();
+        mt.wait_job_done(job);
+
+        ok = ok && job->m_done == 64;
+
+        mt.pop_job(job);
+    }
+
+    check("max_tasks", ok);
+}
+
+// init() again needs terminate() first, a running conveyor keeps its workers
+static void example_reinit(const SchedulerMode mode)
+{
+    MultiTaskOptions options;
+    options.task_threads = 1;
+    options.scheduler = mode;
+
+    MultiTask mt(options);
+
+    bool rejected = false;
+    try
+    {
+        mt.init(options);
+    }
+    catch (const std::logic_error&)
+    {
+        rejected = true;
+    }
+
+    std::atomic_int sum{ 0 };
+    mt.parallel_for(0, 100, 0, [&sum](const int i) { sum += i; });
+
+    mt.terminate();
+    options.task_threads = 2;
+    mt.init(options);
+    mt.parallel_for(0, 100, 0, [&sum](const int i) { sum += i; });
+
+    check("init again", rejected && sum == 2 * 4950 && mt.get_worker_count() == 2);
+}
+
+// the conveyor destroyed while worker tasks wait in parallel_for, the queued parts are dropped and the waits return
+static void example_terminate(const SchedulerMode mode)
+{
+    MultiTaskOptions options;
+    options.task_threads = 2;
+    options.scheduler = mode;
+
+    std::atomic_int started{ 0 };
+    std::atomic_int returned{ 0 };
+    {
+        MultiTask mt(options);
+
+        for (int i = 0; i < 2; ++i)
+            mt.submit(nullptr, [&mt, &started, &returned]() {
+                ++started;
+                mt.parallel_for(0, 1 << 20, 1, [](const int) { std::this_thread::sleep_for(std::chrono::microseconds(1)); });
+                ++returned;
+                });
+
+        while (started == 0)
+            std::this_thread::yield();
+    }
+
+    check("terminate in parallel_for", returned == started);
+}
+
+// c = a + b, d = c * 2, e = c * 3, f = d + e
+class FormulaJob : public GraphJob
+{
+public:
+    void build_graph() override {
+        Node* a = add({}, [this]() { m_a = 1; });
+        Node* b = add({}, [this]() { m_b = 2; });
+        Node* c = add({ a, b }, [this]() { m_c = m_a + m_b; });
+        Node* d = add({ c }, [this]() { m_d = m_c * 2; });
+        Node* e = add({ c }, [this]() { m_e = m_c * 3; });
+        add({ d, e }, [this]() { m_f = m_d + m_e; });
+    }
+
+    void process_after_done() override {}
+
+    int m_a = 0, m_b = 0, m_c = 0, m_d = 0, m_e = 0, m_f = 0;
+
+private:
+    Node* add(const std::vector<Node*>& predecessors, std::function<void()> body) {
+        return emplace_task<FunctionTask<std::function<void()>>>(predecessors, get_id(), std::move(body));
+    }
+};
+
+static void example_graph(MultiTask& mt)
+{
+    FormulaJob* job = mt.emplace_job<FormulaJob>();
+    mt.wait_job_done(job);
+
+    check("graph job", job->m_f == 15);
+
+    mt.pop_job(job);
+}
+
+// numbers go through a parallel stage and a serial stage keeping the source order
+static void example_pipeline(MultiTask& mt)
+{
+    std::vector<int> out;
+
+    auto pipeline = std::make_unique<Pipeline<int>>(4);
+    int next = 0;
+    pipeline->set_source([&next]() { return next < 1000 ? std::optional<int>(next++) : std::nullopt; })
+        .add_stage([](int& item) { item *= 2; })
+        .add_stage([&out](int& item) { out.push_back(item); }, true);
+
+    Pipeline<int>* job = mt.push_job(std::move(pipeline));
+    mt.wait_job_done(job);
+
+    bool ordered = out.size() == 1000;
+    for (size_t i = 0; ordered && i < out.size(); ++i)
+        ordered = out[i] == static_cast<int>(i) * 2;
+
+    check("pipeline", ordered);
+
+    mt.pop_job(job);
+}
+
+// queue wait and run time histograms, per worker, per job and in total
+static void example_latency(MultiTask& mt)
+{
+    mt.reset_latency();
+
+    SumJob* job = mt.emplace_job<SumJob>();
+    mt.wait_job_done(job);
+
+    const LatencySnapshot latency = mt.latency_snapshot();
+
+    unsigned long long worker_tasks = 0;
+    for (const TaskLatency& worker : latency.workers)
+        worker_tasks += worker.run_time.count();
+
+    const auto it = latency.jobs.find(job);
+    check("latency", it != latency.jobs.end() && it->second.run_time.count() == 100 && it->second.queue_wait.count() == 100
+        && worker_tasks == latency.total.run_time.count() && latency.total.run_time.percentile(0.5) <= latency.total.run_time.max_value());
+
+    mt.pop_job(job);
+}
+
+// live counters: a job of 100 tasks shows up in the totals, the queue is empty once it is done
+static void example_stats(MultiTask& mt)
+{
+    const MultiTaskStats before = mt.stats();
+
+    SumJob* job = mt.emplace_job<SumJob>();
+    mt.wait_job_done(job);
+
+    const MultiTaskStats after = mt.stats();
+
+    std::chrono::nanoseconds busy{ 0 };
+    for (const WorkerStats& worker : after.workers)
+        busy += worker.busy;
+
+    check("stats", after.tasks_completed - before.tasks_completed == 100 && after.tasks_pushed - before.tasks_pushed == 100
+        && after.queue_depth == 0 && after.jobs >= 1 && after.workers.size() == 2 && busy.count() > 0);
+
+    mt.pop_job(job);
+}
+
+#ifdef __linux__
+// a long thread_name is cut before the worker index, a cpu that does not exist shows up in the stats
+static void example_thread_options()
+{
+    MultiTaskOptions options;
+    options.task_threads = 11;
+    options.thread_name = "conveyor-worker-long";
+    options.worker_cpus = { { 0 }, { CPU_SETSIZE - 1 } };
+
+    MultiTask mt(options);
+
+    std::vector<std::string> expected;
+    for (int i = 0; i < 11; ++i)
+        expected.push_back(std::string("conveyor-worker-long").substr(0, i < 10 ? 14 : 13) + std::to_string(i));
+    std::sort(expected.begin(), expected.end());
+
+    // workers name themselves when they start
+    std::vector<std::string> names;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (names != expected && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::yield();
+
+        names.clear();
+        for (const auto& thread : std::filesystem::directory_iterator("/proc/self/task"))
+        {
+            std::string name;
+            std::getline(std::ifstream(thread.path() / "comm"), name);
+            if (name.starts_with("conveyor-"))
+                names.push_back(name);
+        }
+        std::sort(names.begin(), names.end());
+    }
+
+    const MultiTaskStats stats = mt.stats();
+
+    check("thread options", names == expected && !stats.workers[0].affinity_failed && stats.workers[1].affinity_failed
+        && !stats.workers[0].scheduling_failed);
+}
+#endif
+
+// sysfs like tree of two nodes with cpus and a memory only node, numa_sysfs_path points the conveyor to it
+static std::string make_numa_tree()
+{
+    const std::filesystem::path root = std::filesystem::temp_directory_path() / "multi_task_conveyor_numa";
+
+    const unsigned int second_cpu = std::thread::hardware_concurrency() > 1 ? 1 : 0;
+    const std::pair<const char*, std::string> files[] = {
+        { "online", "0-2" },
+        { "node0/cpulist", "0" },
+        { "node1/cpulist", std::to_string(second_cpu) },
+        { "node2/cpulist", "" },
+    };
+
+    for (const auto& [name, content] : files)
+    {
+        std::filesystem::create_directories((root / name).parent_path());
+        std::ofstream(root / name) << content << std::endl;
+    }
+
+    return root.string();
+}
+
+static const char* scheduler_name(const SchedulerMode mode)
+{
+    switch (mode)
+    {
+    case SchedulerMode::global_queue: return "global_queue";
+    case SchedulerMode::work_stealing: return "work_stealing";
+    case SchedulerMode::lock_free_ring: return "lock_free_ring";
+    }
+    return "unknown";
+}
+
+int main()
+{
+    const std::string numa_tree = make_numa_tree();
+
+    for (const SchedulerMode mode : { SchedulerMode::global_queue, SchedulerMode::work_stealing, SchedulerMode::lock_free_ring })
+    {
+        for (const bool numa : { false, true })
+        {
+            std::cout << scheduler_name(mode) << (numa ? " numa" : "") << std::endl;
+
+            MultiTaskOptions options;
+            options.task_threads = 2;
+            options.scheduler = mode;
+            options.collect_latency = true;
+            options.numa_aware = numa;
+            options.numa_sysfs_path = numa_tree;
+
+            MultiTask mt(options);
+
+            // the memory only node gets no queue
+            if (numa)
+                check("numa nodes", mt.get_node_count() == 2);
+
+            example_parallel(mt);
+            example_nested_parallel(mt);
+            example_jobs(mt);
+            example_coroutine(mt);
+            if (!numa)
+            {
+                example_priorities(mode);
+                example_self_feeding(mode);
+                if (mode != SchedulerMode::lock_free_ring)
+                    example_fair_share(mode);
+                example_max_tasks(mode);
+                example_elastic_pool(mode);
+                example_reinit(mode);
+                example_terminate(mode);
+            }
+            example_graph(mt);
+            if (!numa)
+                example_fan_out(mt);
+            example_pipeline(mt);
+            example_latency(mt);
+            example_stats(mt);
+        }
+    }
+
+    std::filesystem::remove_all(numa_tree);
+
+#ifdef __linux__
+    example_thread_options();
+#endif
+
+    return g_failed;
+}
@@ -36,8 +36,10 @@ public:
     // override process() function
     void process() override {
 
-        for (int i = 0; i < TASKS; ++i)
-            get_conveyor()->emplace_task<CalcTask>(get_id(), VAL, std::ref(m_res[i]));
+        // push all tasks at once, each generator call returns CalcTask constructor arguments
+        get_conveyor()->emplace_tasks<CalcTask>(TASKS, [this](const size_t i) {
+            return std::make_tuple(get_id(), VAL, std::ref(m_res[i]));
+            });
     }
 
     void process_after_done() override {
@@ -0,0 +1,68 @@
+// trace_example.cpp : the header built with MULTI_TASK_CONVEYOR_TRACE, runs a small job and checks its events
+// in the Chrome trace, returns non zero if any of them is missing
+//
+
+#define MULTI_TASK_CONVEYOR_TRACE
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "MultiThreadTask.h"
+
+using namespace multi_task_conveyor;
+
+static int g_failed = 0;
+
+static void check(const char* example, const bool ok)
+{
+    std::cout << example << ": " << (ok ? "ok" : "FAILED") << std::endl;
+    if (!ok)
+        ++g_failed;
+}
+
+class TracedJob : public Job
+{
+public:
+    void process() override {
+        for (int i = 0; i < 10; ++i)
+            get_conveyor()->submit(get_id(), [this]() { ++m_done; });
+    }
+
+    void process_after_done() override {}
+
+    std::atomic_int m_done{ 0 };
+};
+
+static bool has(const std::string& json, const std::string& text)
+{
+    return json.find(text) != std::string::npos;
+}
+
+int main()
+{
+    Trace::clear();
+
+    {
+        MultiTaskOptions options;
+        options.task_threads = 2;
+
+        MultiTask mt(options);
+
+        TracedJob* job = mt.emplace_job<TracedJob>();
+        mt.wait_job_done(job);
+        check("job done", job->m_done == 10);
+        mt.pop_job(job);
+    }
+
+    std::ostringstream out;
+    Trace::write_chrome_json(out);
+    const std::string json = out.str();
+
+    check("json document", json.rfind("{\"traceEvents\":[", 0) == 0 && has(json, "\n]}\n"));
+    check("task events", has(json, "\"name\":\"task\",\"cat\":\"conveyor\"") && has(json, "\"ph\":\"X\""));
+    check("job events", has(json, "\"name\":\"job process\"") && has(json, "\"name\":\"process_after_done\""));
+    check("push events", has(json, "\"name\":\"push\"") && has(json, "\"ph\":\"i\""));
+    check("thread names", has(json, "\"args\":{\"name\":\"worker 0\"}") && has(json, "\"args\":{\"name\":\"job thread\"}"));
+
+    return g_failed;
+}